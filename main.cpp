@@ -7,19 +7,65 @@
 #define CXXOPTS_NO_REGEX
 #include "src/cxxopts.hpp"
 #include "src/base.hpp"
+#if defined(_WIN32)
 #include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+#include <cstdio>
+
+/*
+	Parse another output of a video, PATH:WIDTHxHEIGHT[:FRAMERATE[:CRF]], 
+	whose framerate and constant rate factor default to the video's. 
+	Paths may contain colons, so the resolution is the last field that 
+	looks like one. Numbers are only digits, as sscanf would take signs.
+*/
+static VideoOutput parse_output(const std::string& spec, unsigned framerate, unsigned crf) {
+	std::vector<std::string> fields;
+	for (size_t begin = 0;;) {
+		const size_t end = spec.find(':', begin);
+		fields.push_back(spec.substr(begin, end - begin));
+		if (end == std::string::npos)
+			break;
+		begin = end + 1;
+	}
+
+	VideoOutput output{"", 0, 0, framerate, crf};
+	for (size_t i = fields.size() - 1; i > 0 && i + 3 >= fields.size(); --i) {
+		int length = 0;
+		if (fields[i].find_first_not_of("0123456789x") != std::string::npos ||
+			sscanf(fields[i].c_str(), "%ux%u%n", &output.width, &output.height, &length) != 2 || length != (int)fields[i].size())
+			continue;
+		for (size_t j = 0; j < i; ++j)
+			output.path += (j != 0 ? ":" : "") + fields[j];
+		unsigned* values[] = {&output.framerate, &output.crf};
+		for (size_t j = i + 1; j < fields.size(); ++j)
+			if (fields[j].find_first_not_of("0123456789") != std::string::npos ||
+				sscanf(fields[j].c_str(), "%u%n", values[j - i - 1], &length) != 1 || length != (int)fields[j].size())
+				output.path.clear();
+		break;
+	}
+	if (output.path.empty() || output.width == 0 || output.height == 0 || output.framerate == 0 || output.crf > 51)
+		fatal_error("Unrecognized output '%s', outputs are 'PATH:WIDTHxHEIGHT[:FRAMERATE[:CRF]]' with a CRF of at most 51", spec.c_str());
+	return output;
+}
 
 /*
 	Parse command-line options to produce a Mandelbrot render.
 			[exe] [format] [output file] [options...]
 */
 int main(int argc, char** argv) {
+	// Render in the background of whatever else the machine runs 
+#if defined(_WIN32)
 	SetPriorityClass(GetCurrentProcess(), IDLE_PRIORITY_CLASS);
+#else
+	setpriority(PRIO_PROCESS, 0, 19);
+#endif
 
 	cxxopts::Options options("Mandelbrot Fractal Zoomer", "Program to render the Mandelbrot set");
 	options.add_options()
 		("format", "How the Mandelbrot set should be rendered", cxxopts::value<std::string>())
-		("output", "Output file/folder of the render", cxxopts::value<std::string>())
+		("output", "Output file/folder of the render (videos may be numbered images, such as 'frames/%05d.qoi')", cxxopts::value<std::string>())
 		("w,width", "Width of render in pixels", cxxopts::value<unsigned>())
 		("h,height", "Height of render in pixels", cxxopts::value<unsigned>())
 		("i,iters", "Iteration count", cxxopts::value<unsigned>())
@@ -30,13 +76,28 @@ int main(int argc, char** argv) {
 		("Z,ezoom", "Ending magnification", cxxopts::value<std::string>())
 		("f,frames", "Number of frames", cxxopts::value<unsigned>())
 		("F,framerate", "Framerate", cxxopts::value<unsigned>())
-		("l,no-log", "Disable logging");
+		("l,no-log", "Disable logging")
+		("orbit-storage", "Reference orbit storage ('double', or 'float' where representable)", cxxopts::value<std::string>())
+		("orbit-cache", "Keep only this many MB of the reference orbit, recomputing the rest from checkpoints", cxxopts::value<unsigned>())
+		("keyframe-buffers", "Number of video keyframes held at once, rendering ahead of frame generation (at least 2)", cxxopts::value<unsigned>())
+		("frame-buffers", "Number of video frames synthesized at once, one per thread (at least 1, at most 256, the frame filters cached)", cxxopts::value<unsigned>())
+		("keyframe-ratio", "Zoom between video keyframes, which are rendered this much larger than frames (above 1, at most 8). Frame filters are only reused when every keyframe interval spans a whole number of frames", cxxopts::value<double>())
+		("foveated-keyframes", "Render video keyframes sparser away from their center, which frames never show at full size")
+		("exponential-map", "Render videos from a single log-polar strip of the whole zoom instead of from keyframes")
+		("keyframe-cache", "Directory video keyframes are cached in, which later renders of the same zoom resume from and 'assemble' reads", cxxopts::value<std::string>())
+		("zoom-out", "Assemble a video zooming out instead of in")
+		("min-iters", "Adapt the iteration count of every video keyframe to what the previous one needed, from this up to the iteration count", cxxopts::value<unsigned>())
+		("crf", "Constant rate factor of the video's x264 encoding (at most 51, lower is better)", cxxopts::value<unsigned>())
+		("extra-output", "Also encode the video to PATH:WIDTHxHEIGHT[:FRAMERATE[:CRF]] from the same keyframes (repeatable)", cxxopts::value<std::string>())
+		("memory-budget", "Hold at most this many MB of pixels, rendering images in bands and videos with fewer buffers", cxxopts::value<unsigned>())
+		("pipe-format", "Pixel format video frames are piped to ffmpeg in ('yuv420p', 'yuv420p10' or 'rgb')", cxxopts::value<std::string>())
+		("segments", "Encode the video in this many parts at once, each by its own ffmpeg, then join them (videos need '--keyframe-cache')", cxxopts::value<unsigned>());
 	options.parse_positional({"format", "output"});
 	auto user = options.parse(argc, argv);
 
 	std::string format = user["format"].as<std::string>();
-	if (format != "image" && format != "video")
-		fatal_error("Unrecognized format '%s', supported formats are ['image', 'video']", format.c_str());
+	if (format != "image" && format != "video" && format != "assemble")
+		fatal_error("Unrecognized format '%s', supported formats are ['image', 'video', 'assemble']", format.c_str());
 	
 	std::string output = user["output"].as<std::string>();
 	unsigned width = user.count("width") != 0 ? user["width"].as<unsigned>() : 1920;
@@ -47,27 +108,121 @@ int main(int argc, char** argv) {
 	std::string zoom = user.count("zoom") != 0 ? user["zoom"].as<std::string>() : "1.0";
 	unsigned prec = user.count("prec") != 0 ? user["prec"].as<unsigned>() : 200;
 	bool log = user.count("no-log") == 0;
+
+	MandelbrotOptions tuning;
+	if (user.count("orbit-storage") != 0) {
+		std::string storage = user["orbit-storage"].as<std::string>();
+		if (storage == "double")
+			tuning.orbit_storage = OrbitStorage::Double;
+		else if (storage == "float")
+			tuning.orbit_storage = OrbitStorage::Float;
+		else
+			fatal_error("Unrecognized orbit storage '%s', supported storages are ['double', 'float']", storage.c_str());
+	}
+	if (user.count("orbit-cache") != 0)
+		tuning.orbit_cache = (size_t)user["orbit-cache"].as<unsigned>() << 20;
+	if (user.count("keyframe-buffers") != 0) {
+		tuning.keyframe_buffers = user["keyframe-buffers"].as<unsigned>();
+		if (tuning.keyframe_buffers < 2)
+			fatal_error("Option '--keyframe-buffers' must be at least 2, but it is %u", tuning.keyframe_buffers);
+	}
+	if (user.count("frame-buffers") != 0) {
+		tuning.frame_buffers = user["frame-buffers"].as<unsigned>();
+		if (tuning.frame_buffers < 1 || tuning.frame_buffers > FRAME_FILTER_CACHE)
+			fatal_error("Option '--frame-buffers' must be at least 1 and at most %u, but it is %u", FRAME_FILTER_CACHE, tuning.frame_buffers);
+	}
+	if (user.count("keyframe-ratio") != 0) {
+		tuning.keyframe_ratio = user["keyframe-ratio"].as<double>();
+		if (!(tuning.keyframe_ratio > 1.0 && tuning.keyframe_ratio <= 8.0))
+			fatal_error("Option '--keyframe-ratio' must be above 1 and at most 8, but it is %g", tuning.keyframe_ratio);
+	}
+	tuning.foveated_keyframes = user.count("foveated-keyframes") != 0;
+	tuning.exponential_map = user.count("exponential-map") != 0;
+	if (user.count("keyframe-cache") != 0)
+		tuning.keyframe_cache = user["keyframe-cache"].as<std::string>();
+	tuning.zoom_out = user.count("zoom-out") != 0;
+	if (user.count("min-iters") != 0) {
+		tuning.min_iterations = user["min-iters"].as<unsigned>();
+		if (tuning.min_iterations < 1 || tuning.min_iterations > iters)
+			fatal_error("Option '--min-iters' must be at least 1 and at most the iteration count %u, but it is %u", iters, tuning.min_iterations);
+	}
+	if (tuning.zoom_out && format != "assemble")
+		fatal_error("Option '--zoom-out' is only supported by format 'assemble'");
+	VideoOptions video;
+	if (user.count("crf") != 0) {
+		video.crf = user["crf"].as<unsigned>();
+		if (video.crf > 51)
+			fatal_error("Option '--crf' must be at most 51, but it is %u", video.crf);
+	}
+	if (user.count("memory-budget") != 0) {
+		tuning.memory_budget = (size_t)user["memory-budget"].as<unsigned>() << 20;
+		if (tuning.memory_budget == 0)
+			fatal_error("Option '--memory-budget' must be at least 1");
+	}
+	if (user.count("pipe-format") != 0) {
+		std::string pixels = user["pipe-format"].as<std::string>();
+		if (pixels == "yuv420p")
+			tuning.pipe_format = FrameFormat::Yuv420;
+		else if (pixels == "yuv420p10")
+			tuning.pipe_format = FrameFormat::Yuv420p10;
+		else if (pixels == "rgb")
+			tuning.pipe_format = FrameFormat::Rgb;
+		else
+			fatal_error("Unrecognized pipe format '%s', supported pipe formats are ['yuv420p', 'yuv420p10', 'rgb']", pixels.c_str());
+	}
+	if (user.count("extra-output") != 0 && format != "video")
+		fatal_error("Option '--extra-output' is only supported by format 'video'");
+	if (user.count("extra-output") != 0 && tuning.exponential_map)
+		fatal_error("Option '--extra-output' is not supported with '--exponential-map'");
+	if (user.count("segments") != 0) {
+		tuning.segments = user["segments"].as<unsigned>();
+		if (tuning.segments < 1)
+			fatal_error("Option '--segments' must be at least 1, but it is %u", tuning.segments);
+		if (format == "image")
+			fatal_error("Option '--segments' is only supported by formats 'video' and 'assemble'");
+		if (user.count("extra-output") != 0 || tuning.exponential_map)
+			fatal_error("Option '--segments' is not supported with '--extra-output' or '--exponential-map'");
+		if (tuning.segments > 1 && tuning.keyframe_cache.empty())
+			fatal_error("Option '--segments' requires parameter '--keyframe-cache' but it is missing");
+	}
+	if (format == "assemble" && tuning.keyframe_cache.empty())
+		fatal_error("Format 'assemble' requires parameter '--keyframe-cache' but it is missing");
 	
 	if (format == "image")
 		mandelbrot_image(
 			output, log,
-			width, height, iters, real.c_str(), imag.c_str(), zoom.c_str(), prec 
+			width, height, iters, real.c_str(), imag.c_str(), zoom.c_str(), prec,
+			tuning 
 		);
-	else if (format == "video") {
+	else {
 		if (user.count("ezoom") == 0)
-			fatal_error("Format 'video' requires parameter '--ezoom' or '-Z' but it is missing");
+			fatal_error("Format '%s' requires parameter '--ezoom' or '-Z' but it is missing", format.c_str());
 		std::string ezoom = user["ezoom"].as<std::string>();
 		if (user.count("frames") == 0)
-			fatal_error("Format 'video' requires parameter '--frames' or '-f' but it is missing");
+			fatal_error("Format '%s' requires parameter '--frames' or '-f' but it is missing", format.c_str());
 		unsigned frames = user["frames"].as<unsigned>();
 		if (user.count("framerate") == 0)
-			fatal_error("Format 'video' requires parameter '--framerate' or '-F' but it is missing");
+			fatal_error("Format '%s' requires parameter '--framerate' or '-F' but it is missing", format.c_str());
 		unsigned framerate = user["framerate"].as<unsigned>();
+		// Every occurrence is one output, as a vector option would split 
+		// paths on commas 
+		for (const cxxopts::KeyValue& argument : user.arguments())
+			if (argument.key() == "extra-output")
+				video.extra_outputs.push_back(parse_output(argument.value(), framerate, video.crf));
 
-		mandelbrot_video(
-			output, log,
-			width, height, iters, real.c_str(), imag.c_str(), zoom.c_str(), prec,
-			ezoom.c_str(), frames, framerate 
-		);
+		if (format == "video")
+			mandelbrot_video(
+				output, log,
+				width, height, iters, real.c_str(), imag.c_str(), zoom.c_str(), prec,
+				ezoom.c_str(), frames, framerate,
+				tuning, video 
+			);
+		else
+			mandelbrot_assemble(
+				output, log,
+				width, height, iters, real.c_str(), imag.c_str(), zoom.c_str(), prec,
+				ezoom.c_str(), frames, framerate,
+				tuning, video 
+			);
 	}
 }
\ No newline at end of file
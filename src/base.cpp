@@ -6,13 +6,19 @@
  */
 #include "./mandelbrot.hpp"
 #include "./base.hpp"
-#include <limits>
-#include <sstream>
+#include "./frame.hpp"
+#include "./expmap.hpp"
+#include "./encoder.hpp"
+#include "./image.hpp"
 #include <chrono>
-#include <cstring>
 #include <cmath>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
 #include <omp.h>
-#include <immintrin.h>
 
 void mandelbrot_image(
 	std::string output,
@@ -23,279 +29,788 @@ void mandelbrot_image(
 	const char* real,
 	const char* imag,
 	const char* zoom,
-	unsigned prec 
+	unsigned prec,
+	const MandelbrotOptions& options 
 ) {
-	// We make a pipe to use with the ffmpeg command-line utility,
-	// and we pipe to it in binary mode.
-	std::stringstream formed;
-	formed << "ffmpeg -f rawvideo -pix_fmt argb -s " << width << "x" << height << " -c:v ppm -i - "
-		   << output << " -s " << width << "x" << height << " -update true -y > NUL 2>&1";
-	auto pipe = _popen(formed.str().c_str(), "wb");
+	// PPM, QOI and PNG images are written directly, and other formats 
+	// by ffmpeg. PNG rows are compressed on every available thread 
+	ImageWriter writer;
+	image_start(writer, output, width, height, std::max(omp_get_max_threads(), 1));
 
-	// If Windows failed to open the pipe, report that error 
-	if (pipe == NULL)
-		fatal_error("Failed opening pipe (Windows error)\n");
+	// Render the image in bands of rows that fit in the memory budget, 
+	// and write every band out as soon as it is done. Bands are 
+	// a multiple of the tile size where possible. Rows are not mirrored 
+	// across the real axis, which is usually in another band 
+	const size_t row_bytes = (size_t)width * 3;
+	unsigned band = height;
+	if (options.memory_budget != 0 && options.memory_budget / (width * BAND_PIXEL_BYTES) < height) {
+		band = (unsigned)std::max<size_t>(options.memory_budget / (width * BAND_PIXEL_BYTES), 1);
+		if (band >= MANDELBROT_TILE)
+			band -= band % MANDELBROT_TILE;
+	}
 
 	// Initialize the MandelbrotGlobals 
 	MandelbrotGlobals globals;
-	unsigned char* pixels = new unsigned char[width * height * 3];
-	mandelbrot_start(globals, pixels, width, height, iterations, real, imag, zoom, prec, zoom);
+	unsigned char* pixels = new unsigned char[band * row_bytes];
+	mandelbrot_start(globals, pixels, width, height, iterations, real, imag, zoom, prec, zoom, options);
+	std::vector<double> rows;
+	if (band < height) {
+		rows.resize(band);
+		globals.row_positions = rows.data();
+	}
 
 	// Generate the Mandelbrot image and time it 
 	auto start = std::chrono::high_resolution_clock::now();
-	mandelbrot(globals);
+	MandelbrotStats stats{};
+	for (unsigned y0 = 0; y0 < height; y0 += band) {
+		globals.height = std::min(band, height - y0);
+		for (unsigned j = 0; j < globals.height && band < height; ++j)
+			rows[j] = (y0 + j) - (height * 0.5) + 0.5;
+		const MandelbrotStats part = mandelbrot(globals);
+		stats.lane_steps += part.lane_steps;
+		stats.lane_slots += part.lane_slots;
+		stats.tile_pixels += part.tile_pixels;
+		image_write(writer, pixels, globals.height);
+	}
 	auto end = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> elapsed = end - start;
 
 	// Log the data 
-	printf("\033[2J\033[HTime taken for image to render: %.4fs\n", elapsed);
+	printf("\033[2J\033[HTime taken for image to render: %.4fs (SIMD lane utilization %.1f%%, %.1f%% of pixels done in tiles)\n", elapsed.count(), 
+		100.0 * mandelbrot_lane_utilization(stats), 100.0 * stats.tile_pixels / ((double)width * height));
 
-	// Relay all of the frame data to ffmpeg 
-	fprintf(pipe, "P6 %d %d 255 ", width, height);
-	fwrite(pixels, 1, width * height * 3, pipe);
+	// Close the image and free the renderer 
+	image_end(writer);
+	mandelbrot_end(globals);
+	delete[] pixels;
+}
+
+/*
+	Directory of the keyframe cache that holds the keyframes of a zoom. 
+	They only depend on its location, starting magnification, precision 
+	and iteration limits, which are compared by value rather than by how 
+	they are written. How keyframes are laid out, keyframe ratio and 
+	foveation included, is in the directory's manifest, and in every 
+	keyframe file, which is not read when it was laid out another way.
+*/
+static std::string keyframe_cache_directory(const std::string& cache, const char* real, const char* imag, const char* zoom, unsigned prec, unsigned iterations, unsigned min_iterations) {
+	std::string key = std::to_string(prec) + " " + std::to_string(iterations);
+	if (min_iterations != 0)
+		key += " " + std::to_string(min_iterations);
+	mpfr_t value;
+	mpfr_init2(value, prec);
+	for (const char* number : {real, imag, zoom}) {
+		mpfr_set_str(value, number, 10, MPFR_RNDN);
+		std::vector<char> text(mpfr_snprintf(nullptr, 0, " %Ra", value) + 1);
+		mpfr_snprintf(text.data(), text.size(), " %Ra", value);
+		key += text.data();
+	}
+	mpfr_clear(value);
 
-	// Close the pipe 
-	_pclose(pipe);
+	// Name the directory by the FNV-1a hash of the key 
+	unsigned long long hash = 14695981039346656037ull;
+	for (char c : key)
+		hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", hash);
+	return (std::filesystem::path(cache) / name).string();
 }
 
-MANDELBROT_INLINE static void calculate_frame_part_1_xy(
-	const double s,
-	const double dx,
-	const double dy,
-	const unsigned x,
-	const unsigned y,
-	const unsigned width,
-	const unsigned height,
-	double* frame,
-	const unsigned char* keyframe0 
-) {
-	const unsigned keyframe_index = 3 * (x + y * width * 2);
-	const double px = s * (x + dx), py = s * (y + dy);
-	const int ix0 = (int)px, ix1 = (int)(px + s),
-				iy0 = (int)py, iy1 = (int)(py + s);
-	
-	#define CHECK(X, Y) if (X >= 0 && Y >= 0 && X < width && Y < height)
-	#define PERFORM(X, Y)													\
-		const double a = ax * ay;											\
-		const unsigned frame_index = 3 * (X + Y * width);					\
-		frame[frame_index + 0] += keyframe0[keyframe_index + 0] * a;		\
-		frame[frame_index + 1] += keyframe0[keyframe_index + 1] * a;		\
-		frame[frame_index + 2] += keyframe0[keyframe_index + 2] * a;
-
-	if (ix0 != ix1) {
-		if (iy0 != iy1) {
-			CHECK(ix0, iy0) {
-				const double ax = ix1 - px,
-								ay = iy1 - py;
-				PERFORM(ix0, iy0)
-			}
-			CHECK(ix1, iy0) {
-				const double ax = px + s - ix1,
-								ay = iy1 - py;
-				PERFORM(ix1, iy0)
-			}
-			CHECK(ix1, iy1) {
-				const double ax = px + s - ix1,
-								ay = py + s - iy1;
-				PERFORM(ix1, iy1)
-			}
+/*
+	Path of keyframe k in a keyframe cache directory.
+*/
+static std::string keyframe_cache_path(const std::string& directory, unsigned k) {
+	char name[32];
+	snprintf(name, sizeof(name), "keyframe_%05u.bin", k);
+	return (std::filesystem::path(directory) / name).string();
+}
+
+/*
+	Write the manifest of a keyframe cache directory, creating it if 
+	needed. It holds the frame resolution, keyframe ratio and whether 
+	keyframes are foveated, which the keyframes were laid out for. It 
+	is only written when it is missing or says something else, so that 
+	renders reading the same keyframes do not rewrite it.
+*/
+static void keyframe_cache_manifest(const std::string& directory, unsigned width, unsigned height, double ratio, bool foveated) {
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	const std::string path = (std::filesystem::path(directory) / "keyframes.txt").string();
+	char manifest[128], existing[128] = "";
+	snprintf(manifest, sizeof(manifest), "%u %u %.17g %d\n", width, height, ratio, (int)foveated);
+	FILE* file = fopen(path.c_str(), "r");
+	if (file != NULL) {
+		existing[fread(existing, 1, sizeof(existing) - 1, file)] = 0;
+		fclose(file);
+	}
+	if (strcmp(manifest, existing) == 0)
+		return;
+
+	file = fopen(path.c_str(), "w");
+	if (file == NULL)
+		fatal_error("Failed writing keyframe cache file '%s'", path.c_str());
+	fputs(manifest, file);
+	fclose(file);
+}
+
+/*
+	Add a keyframe to the cache. It is written to a temporary file 
+	first, so that a render that is killed never leaves a partial 
+	keyframe behind.
+*/
+static void keyframe_cache_save(const FrameKeyframe& keyframe, const std::string& path) {
+	const std::string part = path + ".part";
+	std::error_code error;
+	if (!frame_keyframe_save(keyframe, part.c_str()))
+		fatal_error("Failed writing keyframe cache file '%s'", part.c_str());
+	std::filesystem::rename(part, path, error);
+	if (error)
+		fatal_error("Failed writing keyframe cache file '%s'", path.c_str());
+}
+
+/*
+	A keyframe buffer of the video pipeline.
+*/
+struct KeyframeSlot {
+	FrameKeyframe keyframe;				/* keyframe pixels, at keyframe ratio times the frame resolution */
+	double seconds;						/* time taken to render the keyframe */
+	bool cached;						/* whether the keyframe was read from the keyframe cache */
+	unsigned long long reused;			/* samples copied from the previous keyframe */
+	unsigned iterations;				/* iteration limit of the keyframe (0 if unknown) */
+	MandelbrotStats stats;				/* statistics of the keyframe's render */
+};
+
+/*
+	Print how long a keyframe took to render or to read from the cache.
+*/
+static void keyframe_report(unsigned number, const KeyframeSlot& slot) {
+	if (slot.cached)
+		printf("\033[2J\033[HKeyframe %u loaded from the keyframe cache! %.3fs\n", number, slot.seconds);
+	else
+		printf("\033[2J\033[HKeyframe %u done rendering! %.3fs (%u iterations, SIMD lane utilization %.1f%%, %.1f%% of samples reused)\n", number, slot.seconds,
+			slot.iterations, 100.0 * mandelbrot_lane_utilization(slot.stats), 100.0 * slot.reused / ((double)slot.keyframe.width * slot.keyframe.height));
+}
+
+/*
+	Keyframes of a video are rendered on a background thread into a 
+	ring of buffers, keyframe k into slot k % slots.size(), so that 
+	the next keyframes render while frames are generated from the 
+	current ones. The renderer owns the multiplier, iteration limit and 
+	pixel array of the MandelbrotGlobals while the pipeline runs, and 
+	runs on as many threads as frame synthesis leaves it (see 
+	mandelbrot_video).
+*/
+struct KeyframePipeline {
+	MandelbrotGlobals* globals;			/* renderer state */
+	unsigned iterations;				/* highest iteration limit of a keyframe */
+	std::vector<KeyframeSlot> slots;	/* ring of keyframe buffers */
+	std::vector<double> columns, rows;	/* positions of foveated keyframe samples */
+	std::string cache;					/* directory keyframes are cached in (empty for none) */
+	std::vector<unsigned char> known;	/* samples of the keyframe being rendered that were reused */
+	unsigned rendered;					/* number of keyframes that are done */
+	unsigned released;					/* number of keyframes frame generation is done with */
+	unsigned limit;						/* number of keyframes to render */
+	bool stopped;						/* whether the renderer should exit */
+	std::mutex mutex;					/* guards the counters above */
+	std::condition_variable condition;	/* signalled whenever a counter changes */
+	std::thread renderer;				/* background thread rendering keyframes */
+};
+
+/*
+	Iteration limit of the keyframe after one rendered at `limit` with 
+	the given statistics. Pixels escape later as the zoom goes deeper, 
+	so it is KEYFRAME_ITERATION_HEADROOM times the latest escape. While 
+	pixels are capped and many escape in the last part of the limit, or 
+	none escaped at all, some of the capped ones are probably not 
+	interior, so it is at least doubled.
+*/
+static unsigned keyframe_iterations(const KeyframePipeline& pipeline, unsigned limit, const MandelbrotStats& stats) {
+	double next = KEYFRAME_ITERATION_HEADROOM * stats.max_escape;
+	if (stats.capped != 0 && (stats.escaped == 0 || stats.histogram[MANDELBROT_HISTOGRAM - 1] > KEYFRAME_ITERATION_TAIL * stats.escaped))
+		next = std::max(next, 2.0 * limit);
+	return (unsigned)std::clamp(next, (double)pipeline.globals->options.min_iterations, (double)pipeline.iterations);
+}
+
+/*
+	Copy the samples of an aligned keyframe that are samples of the 
+	previous keyframe as well, which is every ratio-th one from the 
+	center along both axes when the ratio is an integer, and mark them 
+	as known. Returns how many were copied.
+
+	Colors do not depend on the iteration limit, but a pixel that 
+	escapes after a lower limit is black below it, so nothing is 
+	copied from a keyframe with a higher limit, and black samples are 
+	not copied from one with a lower limit.
+*/
+static unsigned long long keyframe_reuse(KeyframePipeline& pipeline, const KeyframeSlot& slot, FrameKeyframe& keyframe) {
+	const FrameKeyframe& previous = slot.keyframe;
+	const double ratio = pipeline.globals->options.keyframe_ratio;
+	const long r = (long)ratio, w = keyframe.width, h = keyframe.height;
+	pipeline.known.assign((size_t)w * h, 0);
+	if (!keyframe.aligned || (double)r != ratio || slot.iterations == 0 || slot.iterations > pipeline.globals->iterations)
+		return 0;
+	const bool interior = slot.iterations == pipeline.globals->iterations;
+
+	unsigned long long reused = 0;
+	#pragma omp parallel for num_threads(pipeline.globals->threads.load()) schedule(dynamic, FRAME_TILE_ROWS) reduction(+:reused)
+	for (long y = 0; y < h; ++y) {
+		const long dy = y - h / 2;
+		if (dy % r != 0)
+			continue;
+		const unsigned char* source = previous.levels[0] + 3 * (size_t)(h / 2 + dy / r) * w;
+		unsigned char* destination = keyframe.levels[0] + 3 * (size_t)y * w;
+		for (long x = (w / 2) % r; x < w; x += r) {
+			const long sx = w / 2 + (x - w / 2) / r;
+			if (!interior && (source[3 * sx + 0] | source[3 * sx + 1] | source[3 * sx + 2]) == 0)
+				continue;
+			destination[3 * x + 0] = source[3 * sx + 0];
+			destination[3 * x + 1] = source[3 * sx + 1];
+			destination[3 * x + 2] = source[3 * sx + 2];
+			pipeline.known[(size_t)y * w + x] = 1;
+			++reused;
+		}
+	}
+	return reused;
+}
+
+/*
+	Body of the keyframe renderer. Keyframe k is rendered at the 
+	starting multiplier divided by ratio^k, as soon as its slot is free.
+
+	With --min-iters, every keyframe is rendered at the iteration limit 
+	the statistics of the previous one call for. A keyframe with none 
+	to go by starts at --min-iters, and is rendered again for as long 
+	as that doubles its limit.
+*/
+static void keyframe_render(KeyframePipeline& pipeline) {
+	MandelbrotGlobals& globals = *pipeline.globals;
+	const bool adaptive = globals.options.min_iterations != 0;
+	bool estimated = false;
+	mpfr_set(globals.multiplier, globals.start_multiplier, MPFR_RNDN);
+	for (unsigned k = 0;; ++k) {
+		{
+			std::unique_lock<std::mutex> lock(pipeline.mutex);
+			pipeline.condition.wait(lock, [&] {
+				return pipeline.stopped || (k < pipeline.limit && k - pipeline.released < pipeline.slots.size());
+			});
+			if (pipeline.stopped)
+				return;
+		}
+
+		// Keyframes in the cache are read instead of rendered, and 
+		// rendered ones are added to it 
+		KeyframeSlot& slot = pipeline.slots[k % pipeline.slots.size()];
+		const std::string path = pipeline.cache.empty() ? std::string() : keyframe_cache_path(pipeline.cache, k);
+		auto start = std::chrono::high_resolution_clock::now();
+		slot.cached = !path.empty() && frame_keyframe_load(slot.keyframe, path.c_str(), globals.threads.load());
+		slot.reused = 0;
+		if (slot.cached) {
+			// Cached keyframes do not record their limit 
+			slot.stats = MandelbrotStats{};
+			slot.iterations = adaptive ? 0 : globals.iterations;
+			estimated = false;
 		} else {
-			CHECK(ix0, iy0) {
-				const double ax = ix1 - px,
-								ay = s;
-				PERFORM(ix0, iy0)
+			if (adaptive && !estimated)
+				globals.iterations = globals.options.min_iterations;
+
+			// Only iterate the samples the previous keyframe does not have 
+			globals.pixels = slot.keyframe.levels[0];
+			globals.known = nullptr;
+			if (k != 0) {
+				slot.reused = keyframe_reuse(pipeline, pipeline.slots[(k - 1) % pipeline.slots.size()], slot.keyframe);
+				globals.known = pipeline.known.data();
 			}
-			CHECK(ix1, iy0) {
-				const double ax = px + s - ix1,
-								ay = s;
-				PERFORM(ix1, iy0)
+			slot.stats = mandelbrot(globals);
+			while (adaptive && !estimated && keyframe_iterations(pipeline, globals.iterations, slot.stats) >= 2ull * globals.iterations) {
+				globals.iterations = keyframe_iterations(pipeline, globals.iterations, slot.stats);
+				globals.known = nullptr;
+				slot.reused = 0;
+				slot.stats = mandelbrot(globals);
 			}
+			slot.iterations = globals.iterations;
+			if (adaptive) {
+				globals.iterations = keyframe_iterations(pipeline, globals.iterations, slot.stats);
+				estimated = true;
+			}
+			frame_keyframe_build(slot.keyframe, globals.threads.load());
+			if (!path.empty())
+				keyframe_cache_save(slot.keyframe, path);
 		}
-	} else {
-		CHECK(ix0, iy0) {
-			const double ax = s,
-							ay = (iy0 == iy1) ? s : (iy1 - py);
-			PERFORM(ix0, iy0)
-		}
-	}
-	if (iy0 != iy1) {
-		CHECK(ix0, iy1) {
-			const double ax = (ix0 == ix1) ? s : (ix1 - px),
-							ay = py + s - iy1;
-			PERFORM(ix0, iy1)
-		}
+		auto end = std::chrono::high_resolution_clock::now();
+		slot.seconds = std::chrono::duration<double>(end - start).count();
+		mpfr_div_d(globals.multiplier, globals.multiplier, globals.options.keyframe_ratio, MPFR_RNDN);
+
+		std::lock_guard<std::mutex> lock(pipeline.mutex);
+		pipeline.rendered = k + 1;
+		pipeline.condition.notify_all();
 	}
 }
 
-MANDELBROT_INLINE static void calculate_frame_part_2_xy(
-	const double s,
-	const double t,
-	const unsigned x,
-	const unsigned y,
-	const unsigned width,
-	const unsigned height,
-	double* frame,
-	const unsigned char* keyframe1 
+/*
+	Start rendering keyframes in the background, for frames of the 
+	given resolution. They have as many levels as frames of the 
+	smallest resolution read. Only as many are rendered as the zoom 
+	from the starting to the ending multiplier needs, unless more are 
+	acquired. With a budget, keyframe buffers take up at most that 
+	many bytes.
+*/
+static void keyframe_start(
+	KeyframePipeline& pipeline,
+	MandelbrotGlobals& globals,
+	unsigned width,
+	unsigned height,
+	unsigned min_width,
+	unsigned min_height,
+	unsigned buffers,
+	size_t budget 
 ) {
-	const double px = s * ((int)x - (int)width) + (width / 2.0),
-					py = s * ((int)y - (int)height) + (height / 2.0);
-	const int ix0 = (int)px, ix1 = (int)(px + s),
-				iy0 = (int)py, iy1 = (int)(py + s);
-	const unsigned keyframe_index = 3 * (x + y * width * 2);
-	const double ax0 = (ix0 == ix1) ? s : (px + s - ix1), ax1 = ix1 - px,
-				ay0 = (iy0 == iy1) ? s : (py + s - iy1), ay1 = iy1 - py;
-	for (int ix = ix0; ix <= ix1; ++ix) {
-		for (int iy = iy0; iy <= iy1; ++iy) {
-			const double ax = (ix == ix1) ? ax0 : ax1,
-						ay = (iy == iy1) ? ay0 : ay1;
-			const double a = ax * ay;
-			const unsigned frame_index = 3 * (ix + iy * width);
-			frame[frame_index + 0] += (double)keyframe1[keyframe_index + 0] * a * t;
-			frame[frame_index + 1] += (double)keyframe1[keyframe_index + 1] * a * t;
-			frame[frame_index + 2] += (double)keyframe1[keyframe_index + 2] * a * t;
-		}
+	const MandelbrotOptions& options = globals.options;
+	pipeline.globals = &globals;
+	pipeline.iterations = globals.iterations;
+	pipeline.slots.resize(1);
+	frame_keyframe_start(pipeline.slots[0].keyframe, width, height, options.keyframe_ratio, options.foveated_keyframes);
+	frame_keyframe_levels(pipeline.slots[0].keyframe, min_width, min_height, options.keyframe_ratio);
+
+	// Render the keyframe's samples, which are the uniform grid the 
+	// globals were started with (aligned) unless they are foveated 
+	const FrameKeyframe& layout = pipeline.slots[0].keyframe;
+	globals.aligned = layout.aligned;
+	if (options.foveated_keyframes) {
+		for (unsigned x = 0; x < layout.width; ++x)
+			pipeline.columns.push_back(0.5 * (layout.columns[x] + layout.columns[x + 1]) - 0.5 * layout.span_width);
+		for (unsigned y = 0; y < layout.height; ++y)
+			pipeline.rows.push_back(0.5 * (layout.rows[y] + layout.rows[y + 1]) - 0.5 * layout.span_height);
+		globals.width = layout.width;
+		globals.height = layout.height;
+		globals.column_positions = pipeline.columns.data();
+		globals.row_positions = pipeline.rows.data();
+	}
+
+	// Render two keyframes ahead when their buffers (with every level) 
+	// take up at most a gigabyte, otherwise one, and no further than the 
+	// budget allows (next to the mask of reused samples and the 
+	// renderer's bookkeeping) 
+	const size_t keyframe = frame_keyframe_bytes(layout), bookkeeping = KEYFRAME_SAMPLE_BYTES * (size_t)layout.width * layout.height;
+	if (buffers == 0)
+		buffers = 4 * keyframe <= ((size_t)1 << 30) ? 4 : 3;
+	if (budget != 0) {
+		const size_t fit = budget > bookkeeping ? (budget - bookkeeping) / keyframe : 0;
+		if (fit < 2)
+			fatal_error("Option '--memory-budget' leaves %zu MB for keyframes, but two keyframes and their bookkeeping take %zu MB", 
+				budget >> 20, (2 * keyframe + bookkeeping + ((size_t)1 << 20) - 1) >> 20);
+		buffers = (unsigned)std::min<size_t>(buffers, fit);
 	}
+	pipeline.slots.resize(buffers);
+	for (unsigned i = 1; i < buffers; ++i) {
+		frame_keyframe_start(pipeline.slots[i].keyframe, width, height, options.keyframe_ratio, options.foveated_keyframes);
+		frame_keyframe_levels(pipeline.slots[i].keyframe, min_width, min_height, options.keyframe_ratio);
+	}
+	pipeline.rendered = pipeline.released = 0;
+	pipeline.stopped = false;
+
+	// Frames zooming past keyframe k use keyframes k and k + 1, and the 
+	// last frame zooms log(start / end) / log(ratio) keyframes deep 
+	mpfr_t depth;
+	mpfr_init2(depth, globals.precision);
+	mpfr_div(depth, globals.start_multiplier, globals.end_multiplier, MPFR_RNDN);
+	mpfr_log2(depth, depth, MPFR_RNDN);
+	const double keyframes = std::floor(mpfr_get_d(depth, MPFR_RNDN) / std::log2(globals.options.keyframe_ratio)) + 2.0;
+	pipeline.limit = keyframes > 2.0 ? (unsigned)std::min(keyframes, 1e9) : 2;
+	mpfr_clear(depth);
+
+	pipeline.renderer = std::thread(keyframe_render, std::ref(pipeline));
 }
 
-MANDELBROT_INLINE static void calculate_frame(
-	const double Z0,
-	const unsigned width,
-	const unsigned height,
-	double* frame,
-	const unsigned char* keyframe0,
-	const unsigned char* keyframe1 
-) {
-	// Set the entire frame to black 
-	if constexpr (std::numeric_limits<double>::is_iec559)
-		memset(frame, 0, width * height * 3 * sizeof(double));
-	else 
-		for (unsigned i = 0; i != width * height * 3; ++i)
-			frame[i] = 0.0;
-	
-	// PART 1: Zoom into the current keyframe 
+/*
+	Whether the renderer has keyframes left to render.
+*/
+static bool keyframe_rendering(KeyframePipeline& pipeline) {
+	std::lock_guard<std::mutex> lock(pipeline.mutex);
+	return pipeline.rendered < pipeline.limit;
+}
+
+/*
+	Wait until keyframe k is rendered, and return its buffer.
+*/
+static const KeyframeSlot& keyframe_acquire(KeyframePipeline& pipeline, unsigned k) {
+	std::unique_lock<std::mutex> lock(pipeline.mutex);
+	if (pipeline.limit <= k) {
+		pipeline.limit = k + 1;
+		pipeline.condition.notify_all();
+	}
+	pipeline.condition.wait(lock, [&] { return pipeline.rendered > k; });
+	return pipeline.slots[k % pipeline.slots.size()];
+}
+
+/*
+	Hand the buffer of keyframe k, and of every keyframe before it, 
+	back to the renderer.
+*/
+static void keyframe_release(KeyframePipeline& pipeline, unsigned k) {
+	std::lock_guard<std::mutex> lock(pipeline.mutex);
+	pipeline.released = k + 1;
+	pipeline.condition.notify_all();
+}
+
+/*
+	Stop the renderer and free every keyframe buffer.
+*/
+static void keyframe_stop(KeyframePipeline& pipeline) {
 	{
-		const double s = 0.5 / Z0;
-		const double dx = (Z0 - 1.0) * width, dy = (Z0 - 1.0) * height;
-		const unsigned xlo = width * (1.0 - Z0), xhi = width * (1.0 + Z0),
-					   ylo = height * (1.0 - Z0), yhi = height * (1.0 + Z0);
-		const int num_threads = 16;
+		std::lock_guard<std::mutex> lock(pipeline.mutex);
+		pipeline.stopped = true;
+		pipeline.condition.notify_all();
+	}
+	pipeline.renderer.join();
+	for (KeyframeSlot& slot : pipeline.slots)
+		frame_keyframe_end(slot.keyframe);
+}
 
-		#pragma omp parallel num_threads(num_threads)
-		{
-			const int thread_num = omp_get_thread_num();
+/*
+	Open a pipe to ffmpeg that encodes the frames written to it into 
+	a video. RGB frames come as PPM images that ffmpeg converts to 
+	YUV, and YUV frames as a Y4M stream that it encodes as is.
+*/
+static EncoderPipe video_pipe(const std::string& output, unsigned width, unsigned height, unsigned framerate, unsigned crf, FrameFormat format) {
+	// We do the same thing as the image function, but use a different 
+	// ffmpeg command.
+	std::vector<std::string> command;
+	if (format == FrameFormat::Rgb)
+		command = {"ffmpeg", "-f", "image2pipe", "-framerate", std::to_string(framerate), "-c:v", "ppm", "-i", "-", 
+			"-c:v", "libx264", "-crf", std::to_string(crf), "-vf", "scale=" + std::to_string(width) + ":" + std::to_string(height) + ",format=yuv420p"};
+	else
+		command = {"ffmpeg", "-f", "yuv4mpegpipe", "-i", "-", "-c:v", "libx264", "-crf", std::to_string(crf), 
+			"-pix_fmt", format == FrameFormat::Yuv420 ? "yuv420p" : "yuv420p10le", 
+			"-color_primaries", "bt709", "-color_trc", "bt709", "-colorspace", "bt709", "-color_range", "tv"};
+	command.insert(command.end(), {"-movflags", "+faststart", output, "-y"});
+	return encoder_pipe_open(command);
+}
 
-			for (unsigned y = ylo + ((yhi - ylo) * thread_num) / num_threads; y < ylo + ((yhi - ylo) * (thread_num + 1)) / num_threads - 3; ++y)
-				for (unsigned x = xlo; x < xhi; ++x)
-					calculate_frame_part_1_xy(s, dx, dy, x, y, width, height, frame, keyframe0);
-		}
+/*
+	Format the frames of an output are synthesized in. Image sequences 
+	are written from RGB frames.
+*/
+static FrameFormat video_format(const MandelbrotOptions& options, const VideoOutput& output) {
+	return encoder_sequence(output.path) ? FrameFormat::Rgb : options.pipe_format;
+}
 
-		for (unsigned d = 1; d < num_threads; ++d)
-			for (unsigned y = ylo + ((yhi - ylo) * d) / num_threads - 3; y < ylo + ((yhi - ylo) * d) / num_threads; ++y)
-				for (unsigned x = xlo; x < xhi; ++x)
-					calculate_frame_part_1_xy(s, dx, dy, x, y, width, height, frame, keyframe0);
+/*
+	Start encoding an output with `buffers` frame buffers, either 
+	through a pipe to ffmpeg or to numbered images, whose directory 
+	is created.
+*/
+static void video_start(Encoder& encoder, EncoderPipe& pipe, const VideoOutput& output, FrameFormat format, unsigned buffers) {
+	if (encoder_sequence(output.path)) {
+		std::error_code error;
+		const std::filesystem::path directory = std::filesystem::path(output.path).parent_path();
+		if (!directory.empty())
+			std::filesystem::create_directories(directory, error);
+		encoder_start_sequence(encoder, output.path, output.width, output.height, buffers);
+	}
+	else {
+		pipe = video_pipe(output.path, output.width, output.height, output.framerate, output.crf, format);
+		encoder_start(encoder, pipe, output.width, output.height, output.framerate, format, buffers);
 	}
+}
 
-	// PART 2: Blend the next keyframe with a portion of the current image 
-	{
-		const double t = 2.0 - 2.0 * Z0;
-		const double s = 0.25 / Z0;
-		unsigned xlo, xhi, ylo, yhi;
-		int ixlo = 0, ixhi = 0, iylo = 0, iyhi = 0;
-		double ixlo_d = 0.0, ixhi_d = 0.0, iylo_d = 0.0, iyhi_d = 0.0;
-		for (xlo = 0; xlo != width * 2; ++xlo)
-			if ((ixlo = (ixlo_d = s * ((int)xlo - (int)width) + (width / 2.0))) >= 0)
-				break;
-		for (xhi = width * 2 - 1; xhi != 0; --xhi)
-			if ((ixhi = (ixhi_d = s * ((int)xhi - (int)width + 1) + (width / 2.0))) < width)
-				break;
-		for (ylo = 0; ylo != height * 2; ++ylo)
-			if ((iylo = (iylo_d = s * ((int)ylo - (int)height) + (height / 2.0))) >= 0)
-				break;
-		for (yhi = height * 2 - 1; yhi != 0; --yhi)
-			if ((iyhi = (iyhi_d = s * ((int)yhi - (int)height + 1) + (height / 2.0))) < height)
-				break;
-		for (int iy = iylo; iy <= iyhi; ++iy) {
-			for (int ix = ixlo; ix <= ixhi; ++ix) {
-				const unsigned frame_index = 3 * (ix + iy * width);
-				double m = 1.0;
-				if (ix == ixlo)
-					m *= ixlo + 1.0 - ixlo_d;
-				else if (ix == ixhi)
-					m *= ixhi_d - ixhi;
-				if (iy == iylo)
-					m *= iylo + 1.0 - iylo_d;
-				else if (iy == iyhi)
-					m *= iyhi_d - iyhi;
-				
-				m = 1.0 - m * t;
-				frame[frame_index + 0] *= m;
-				frame[frame_index + 1] *= m;
-				frame[frame_index + 2] *= m;
-			}
+/*
+	Finish encoding an output once every frame is submitted.
+*/
+static void video_stop(Encoder& encoder, const VideoOutput& output) {
+	if (!encoder_stop(encoder))
+		fatal_error("ffmpeg failed encoding '%s'", output.path.c_str());
+}
+
+/*
+	Bytes of the frame buffers the encoder of an output keeps to fill 
+	its pipe, next to the ones it is started with.
+*/
+static size_t video_pipe_bytes(const MandelbrotOptions& options, const VideoOutput& output) {
+	return encoder_sequence(output.path) ? 0 : encoder_pipe_bytes(output.width, output.height, video_format(options, output));
+}
+
+/*
+	How deep a zoom from `zoom` to `ezoom` goes, in keyframes: 
+	log(ezoom / zoom) / log(ratio). Its last frame reads keyframes 
+	floor of that and the one after.
+*/
+static double video_keyframe_depth(const char* zoom, const char* ezoom, unsigned prec, double ratio) {
+	mpfr_t depth, temp;
+	mpfr_inits2(prec, depth, temp, (mpfr_ptr)0);
+	mpfr_set_str(depth, ezoom, 10, MPFR_RNDN);
+	mpfr_set_str(temp, zoom, 10, MPFR_RNDN);
+	mpfr_div(depth, depth, temp, MPFR_RNDN);
+	mpfr_log(depth, depth, MPFR_RNDN);
+	const double keyframe_depth = mpfr_get_d(depth, MPFR_RNDN) / std::log(ratio);
+	mpfr_clears(depth, temp, (mpfr_ptr)0);
+	return keyframe_depth;
+}
+
+/*
+	Path segment s of a video is encoded to before the segments are 
+	joined, next to the video.
+*/
+static std::string video_segment_path(const std::string& output, unsigned s) {
+	std::filesystem::path path(output);
+	const std::string extension = path.extension().string();
+	return path.replace_extension(".segment" + std::to_string(s + 1) + extension).string();
+}
+
+/*
+	Join the segments of a video into it without re-encoding them, 
+	with ffmpeg's concat demuxer, and delete them. If ffmpeg fails, 
+	the segments are kept.
+*/
+static void video_concat(const std::string& output, const std::vector<std::string>& segments) {
+	const std::string list = output + ".segments.txt";
+	FILE* file = fopen(list.c_str(), "w");
+	if (file == NULL)
+		fatal_error("Failed writing segment list '%s'", list.c_str());
+	for (const std::string& segment : segments) {
+		// Paths are quoted, with quotes in them written as '\'' 
+		std::string quoted;
+		for (char c : std::filesystem::absolute(segment).string())
+			quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+		fprintf(file, "file '%s'\n", quoted.c_str());
+	}
+	fclose(file);
+
+	EncoderPipe pipe = encoder_pipe_open({"ffmpeg", "-f", "concat", "-safe", "0", "-i", list, "-c", "copy", "-movflags", "+faststart", output, "-y"});
+	if (!encoder_pipe_close(pipe))
+		fatal_error("ffmpeg failed joining the segments listed in '%s' into '%s', which are kept", list.c_str(), output.c_str());
+	std::error_code error;
+	for (const std::string& segment : segments)
+		std::filesystem::remove(segment, error);
+	std::filesystem::remove(list, error);
+}
+
+/*
+	Print how an encoder kept up since the last report. Synthesis 
+	waiting for buffers means ffmpeg (or the disk) is the bottleneck, 
+	and a queue that is mostly empty means rendering is.
+*/
+static void encoder_report(Encoder& encoder) {
+	const EncoderStats stats = encoder_stats(encoder);
+	printf("Encoder queue %.1f frames deep on average (at most %u), %.3fs writing frames, %.3fs waiting for the writers\n", 
+		(double)stats.depth / std::max(stats.frames, 1ull), stats.max_depth, stats.write_seconds, stats.wait_seconds);
+}
+
+/*
+	Render a video from a log-polar strip of the whole zoom (see 
+	expmap.hpp), rendering bands of the strip as the frames reach them.
+*/
+static void mandelbrot_video_expmap(const VideoOutput& output, MandelbrotGlobals& globals, unsigned frames) {
+	ExpmapStrip strip;
+	expmap_start(strip, output.width, output.height);
+	Encoder encoder;
+	EncoderPipe pipe;
+	video_start(encoder, pipe, output, FrameFormat::Rgb, ENCODER_BATCHES);
+
+	// Frames zoom in by the same factor each, which is a fixed number 
+	// of strip rows 
+	mpfr_t depth;
+	mpfr_init2(depth, globals.precision);
+	mpfr_div(depth, globals.start_multiplier, globals.end_multiplier, MPFR_RNDN);
+	mpfr_log(depth, depth, MPFR_RNDN);
+	const double rows = frames > 1 ? mpfr_get_d(depth, MPFR_RNDN) / strip.step / (frames - 1) : 0.0;
+	mpfr_clear(depth);
+
+	unsigned frameno = 0, oldframeno = 0;
+	while (frameno < frames) {
+		// Render the next band, once the bands the current frame no 
+		// longer reads are freed 
+		expmap_release(strip, frameno * rows);
+		auto start = std::chrono::high_resolution_clock::now();
+		const MandelbrotStats stats = expmap_render(strip, globals);
+		auto end = std::chrono::high_resolution_clock::now();
+		printf("\033[2J\033[HStrip band %u done rendering! %.3fs (SIMD lane utilization %.1f%%)\n", strip.rendered,
+			std::chrono::duration<double>(end - start).count(), 100.0 * mandelbrot_lane_utilization(stats));
+
+		// Generate every frame the rendered bands hold 
+		auto start1 = std::chrono::high_resolution_clock::now();
+		for (oldframeno = frameno; frameno < frames && expmap_ready(strip, frameno * rows); ++frameno) {
+			unsigned char* frame = encoder_acquire(encoder);
+			expmap_frame(strip, frameno * rows, frame, globals.threads.load());
+			encoder_submit(encoder, frame);
+		}
+		auto end1 = std::chrono::high_resolution_clock::now();
+		if (frameno != oldframeno) {
+			printf("Frames %d-%d done rendering! %.3fs\n", oldframeno, frameno, std::chrono::duration<double>(end1 - start1).count());
+			encoder_report(encoder);
 		}
+	}
 
-		{
-			const int num_threads = 16;
+	video_stop(encoder, output);
+	expmap_end(strip);
+}
 
-			#pragma omp parallel num_threads(num_threads)
-			{
-				const int thread_num = omp_get_thread_num();
+/*
+	Number of frames a video synthesizes at once: one per thread by 
+	default, but no more than the filter cache holds (a batch points 
+	into it, so none of its filters may be dropped), or than fit in the 
+	memory budget next to the `held` bytes of keyframes and frames in 
+	pipes (at least one). Encoders hold ENCODER_BATCHES batches of 
+	frames of `bytes` each.
+*/
+static unsigned video_frame_buffers(const MandelbrotOptions& options, size_t bytes, size_t held) {
+	unsigned buffers = std::min<unsigned>(options.frame_buffers != 0 ? options.frame_buffers : std::min(omp_get_max_threads(), FRAME_BUFFERS), FRAME_FILTER_CACHE);
+	if (options.memory_budget != 0)
+		buffers = (unsigned)std::clamp<size_t>((options.memory_budget - std::min(held, options.memory_budget)) / (ENCODER_BATCHES * bytes), 1, buffers);
+	return buffers;
+}
 
-				for (unsigned y = ylo + ((yhi - ylo) * thread_num) / num_threads; y < ylo + ((yhi - ylo) * (thread_num + 1)) / num_threads - 3; ++y)
-					for (unsigned x = xlo; x <= xhi; ++x)
-						calculate_frame_part_2_xy(s, t, x, y, width, height, frame, keyframe1);
-			}
+/*
+	An output of a keyframe video, and how far its frames are generated.
+*/
+struct VideoStream {
+	VideoOutput output;					/* file, resolution and encoder settings */
+	unsigned frames;					/* number of frames */
+	unsigned frameno;					/* number of frames generated */
+	EncoderPipe pipe;					/* pipe to ffmpeg */
+	Encoder encoder;					/* writer of its frames to the pipe */
+	mpfr_t multiplier;					/* multiplier of the next frame */
+	FrameFilterCache filters;			/* filters of its recent frames */
+};
 
-			for (unsigned d = 1; d <= num_threads; ++d)
-				for (unsigned y = ylo + ((yhi - ylo) * d) / num_threads - 3; y < ylo + ((yhi - ylo) * d) / num_threads; ++y)
-					for (unsigned x = xlo; x <= xhi; ++x)
-						calculate_frame_part_2_xy(s, t, x, y, width, height, frame, keyframe1);
-			for (unsigned x = xlo; x <= xhi; ++x)
-				calculate_frame_part_2_xy(s, t, x, yhi, width, height, frame, keyframe1);
+/*
+	Synthesize the first `count` frames of a batch from both keyframes 
+	on up to `threads` threads, one frame per thread, and queue them 
+	for an encoder in order as they finish. A single frame is 
+	synthesized with every thread.
+*/
+static void video_batch(
+	Encoder& encoder,
+	const std::vector<const FrameFilter*>& batch,
+	unsigned count,
+	const FrameKeyframe& keyframe0,
+	const FrameKeyframe& keyframe1,
+	unsigned threads 
+) {
+	#pragma omp parallel for num_threads(threads) schedule(static, 1) ordered if(count > 1)
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned char* frame = encoder_acquire(encoder);
+		frame_synthesize(*batch[i], frame, keyframe0, keyframe1, encoder.format, threads);
+
+		#pragma omp ordered
+		encoder_submit(encoder, frame);
+	}
+}
+
+/*
+	Generate the frames of an output that zoom into keyframe0 until the 
+	globals' half keyframe multiplier, in batches of `batch.size()` 
+	frames synthesized on up to `threads` threads, and hand them to its 
+	encoder in order.
+*/
+static void video_frames(
+	VideoStream& stream,
+	const MandelbrotGlobals& globals,
+	const FrameKeyframe& keyframe0,
+	const FrameKeyframe& keyframe1,
+	std::vector<const FrameFilter*>& batch,
+	unsigned threads 
+) {
+	const double ratio = globals.options.keyframe_ratio;
+	const unsigned width = stream.output.width, height = stream.output.height, frames = stream.frames;
+	unsigned& frameno = stream.frameno;
+	mpfr_t temp0, temp1;
+	mpfr_inits2(globals.precision, temp0, temp1, (mpfr_ptr)0);
+
+	// While the frame can be scaled down from the keyframe 
+	while (mpfr_cmp(stream.multiplier, globals.half_keyframe_multiplier) > 0 && frameno < frames) {
+		unsigned count = 0;
+		for (; count < batch.size() && mpfr_cmp(stream.multiplier, globals.half_keyframe_multiplier) > 0 && frameno < frames; ++count, ++frameno) {
+			// Calculate the zoom-in amount, 0 < Z0 ≤ 1, with respect to the keyframe 
+			mpfr_div(temp0, stream.multiplier, globals.keyframe_multiplier, MPFR_RNDN);
+			const double Z0 = mpfr_get_d(temp0, MPFR_RNDN);
+			batch[count] = &frame_filter(stream.filters, Z0, ratio, width, height, keyframe0);
+
+			// Adjust multiplier 
+			const double ratio = (double)(frameno + 1) / (frames - 1);
+			mpfr_div(temp0, globals.end_multiplier, globals.start_multiplier, MPFR_RNDN);
+			mpfr_set_d(temp1, ratio, MPFR_RNDN);
+			mpfr_pow(temp0, temp0, temp1, MPFR_RNDN);
+			mpfr_mul(stream.multiplier, temp0, globals.start_multiplier, MPFR_RNDN);
 		}
+
+		video_batch(stream.encoder, batch, count, keyframe0, keyframe1, threads);
 	}
+	mpfr_clears(temp0, temp1, (mpfr_ptr)0);
 }
 
 // Rendering Mandelbrot fractals can take time. However, there are 
 // two rendering optimizations that can be done:
 //
 // [PIXEL REUSE]
-//   This method reuses pixels from one frame to another, causing 
-//   massive speedups every frame.
+//   This method reuses pixels from one keyframe to the next. Keyframe 
+//   grids are aligned on their center, so with an integer keyframe 
+//   ratio, every ratio-th sample of a keyframe was already a sample of 
+//   the previous one, and is copied instead of iterated (a quarter of 
+//   them at the default ratio of 2).
 //
 // [RENDERING KEYFRAMES]
 //   This renders the Mandelbrot zoom with keyframes, which makes 
 //   the cumulative time spent depend more on the final magnification 
 //   instead of frames needed to generate. In this case,
-//   a 2x higher-resolution image will be generated, then all of the 
-//   frames up until it gets to 2x more magnification will just be 
-//   downscales of that one.
+//   a higher-resolution image (2x by default, the keyframe ratio) will 
+//   be generated, then all of the frames up until it gets to that much 
+//   more magnification will just be downscales of that one.
 //
-// The optimization implemented right now is rendering keyframes. We 
-// continuously double the magnification until it exceeds the actual 
-// final magnification. We double the magnification when the current 
-// frame exceeds double the current magnification.
+// Both are implemented. For the keyframes, we continuously multiply 
+// the magnification by the keyframe ratio until it exceeds the actual 
+// final magnification. We do so when the current frame exceeds the 
+// keyframe ratio times the current magnification.
 //
 // NOTE: Magnification is inverse multiplier.
 //
-// NOTE: 0 < Z0 ≤ 1 is the multiplier of a frame divided by the multiplier 
+// NOTE: 1 / ratio < Z0 ≤ 1 is the multiplier of a frame divided by the multiplier 
 //       of its corresponding keyframe.
 //
 // To calculate the image from the keyframe image with respect to Z0,
 // we have to crop the center of the keyframe image to Z0 and scale to 
 // the frame resolution.
 //
-// For each keyframe pixel, we calculate the resulting floating pixel 
-// after the abforementioned translation, and check which frame pixels 
-// it intersects. For each of those pixels, we blend the keyframe pixel 
-// color with it multiplied by how much the keyframe pixel intersects 
-// with that pixel.
-//
-// Since pixels will only strictly get smaller, we do not assume that a 
-// transformed scaled keyframe pixel does not intersect more than two 
-// frame pixels.
+// For each frame pixel, we calculate the floating footprint it covers 
+// in the keyframe after the abforementioned translation, and blend the 
+// keyframe pixels it intersects, each multiplied by how much of the 
+// footprint it covers (see frame.hpp). Keyframes larger than 2x are 
+// read from downscaled copies of themselves, so that a footprint never 
+// covers more than a few keyframe pixels.
 //
 // NOTE: We do use OpenMP to parallelize this image processing.
+//
+// [EXPONENTIAL MAP]
+//   With --exponential-map, the zoom is instead rendered once as a 
+//   log-polar strip, where rows are rings and columns are angles, and 
+//   every frame is a window of its rows bent back into a disk. Each 
+//   ring is rendered once, at the density the outer edge of a frame 
+//   shows it at, instead of again in every keyframe.
+//
+// [MULTIPLE OUTPUTS]
+//   With --extra-output, the same keyframes are resampled into every 
+//   output, each with its own frames and ffmpeg pipe. Keyframes are 
+//   rendered for the largest output, so smaller ones only read them 
+//   from coarser levels. The main output is only the same as when it 
+//   is rendered alone if no extra output is larger than it.
+//
+// [IMAGE SEQUENCES]
+//   An output whose path has a %d, such as frames/%05d.qoi, is written 
+//   as numbered PPM, QOI or PNG images instead of a video, by a pool 
+//   of writer threads, so that neither encoding nor the disk holds up 
+//   synthesis.
+//
+// [YUV FRAMES]
+//   Frames are converted to BT.709 YUV 4:2:0 as they are synthesized, 
+//   and piped to ffmpeg as a Y4M stream, which is half the bytes of 
+//   RGB and leaves ffmpeg nothing to convert. --pipe-format=rgb pipes 
+//   PPM images instead, which exponential-map videos always do.
+//
+// [SEGMENTED ENCODING]
+//   With --segments, a video is cut into contiguous parts at keyframe 
+//   boundaries, and every part is encoded by its own ffmpeg at once, 
+//   so that encoding is not held to what one x264 process does. The 
+//   keyframes are rendered into the keyframe cache first, and the 
+//   parts are synthesized from it and joined by a stream copy.
 void mandelbrot_video(
 	std::string output,
 	bool log,
@@ -308,110 +823,350 @@ void mandelbrot_video(
 	unsigned prec,
 	const char* ezoom,
 	unsigned frames,
-	unsigned framerate 
+	unsigned framerate,
+	const MandelbrotOptions& options,
+	const VideoOptions& video 
 ) {
-	// We do the same thing as the image function, but use a different 
-	// ffmpeg command.
-	std::stringstream formed;
-	formed << "ffmpeg -f image2pipe -framerate " << framerate << " -c:v ppm -i - "
-		   << "-c:v libx264 -crf 18 -vf \"scale=" << width << ":" << height << ",format=yuv420p\" "
-		   << "-movflags +faststart " << output << " -y > NUL 2>&1";
-	auto pipe = _popen(formed.str().c_str(), "wb");
-
-	// If Windows failed to open the pipe, report that error 
-	if (pipe == NULL)
-		fatal_error("Failed opening pipe (Windows error)\n");
-
-	// Initialize the MandelbrotGlobals (and both keyframe buffers)
+	// Exponential maps are rendered at the frame resolution 
 	MandelbrotGlobals globals;
-	unsigned char* keyframe0 = new unsigned char[width * height * 12];
-	unsigned char* keyframe1 = new unsigned char[width * height * 12];
-	mandelbrot_start(globals, keyframe1, width * 2, height * 2, iterations, real, imag, zoom, prec, ezoom);
+	if (options.exponential_map) {
+		mandelbrot_start(globals, nullptr, width, height, iterations, real, imag, zoom, prec, ezoom, options);
+		mandelbrot_video_expmap(VideoOutput{output, width, height, framerate, video.crf}, globals, frames);
+		mandelbrot_end(globals);
+		return;
+	}
 
-	// Form a normal-resolution copy of pixels for normal frame generation 
-	__attribute__((aligned(16))) double* frame_raw = new double[width * height * 3];
-	__attribute__((aligned(16))) unsigned char* frame = new unsigned char[width * height * 3];
+	// Segmented videos render every keyframe into the cache first, and 
+	// are then assembled from it with an ffmpeg per segment 
+	if (options.segments > 1 && !encoder_sequence(output)) {
+		const double ratio = options.keyframe_ratio;
+		mandelbrot_start(globals, nullptr, frame_keyframe_size(width, ratio), frame_keyframe_size(height, ratio), iterations, real, imag, zoom, prec, ezoom, options);
+		KeyframePipeline pipeline;
+		pipeline.cache = keyframe_cache_directory(options.keyframe_cache, real, imag, zoom, prec, iterations, options.min_iterations);
+		keyframe_cache_manifest(pipeline.cache, width, height, ratio, options.foveated_keyframes);
 
-	// Initialize the first keyframe buffer and time it 
-	{
-		auto start = std::chrono::high_resolution_clock::now();
+		// Leave the budget room for the frame buffers of every segment's 
+		// encoder, as an unsegmented video does 
+		const VideoOutput segment{output, width, height, framerate, video.crf};
+		const size_t encoder_bytes = options.segments * (ENCODER_BATCHES * frame_bytes(width, height, video_format(options, segment)) + video_pipe_bytes(options, segment));
+		if (options.memory_budget != 0 && options.memory_budget <= encoder_bytes)
+			fatal_error("Option '--memory-budget' must leave room for %u frames of every segment and the frames in its pipe, which take %zu MB", 
+				ENCODER_BATCHES, (encoder_bytes + ((size_t)1 << 20) - 1) >> 20);
+		keyframe_start(pipeline, globals, width, height, width, height, options.keyframe_buffers, 
+			options.memory_budget != 0 ? options.memory_budget - encoder_bytes : 0);
+		const unsigned keyframes = (unsigned)std::max(std::floor(video_keyframe_depth(zoom, ezoom, prec, ratio)), 0.0) + 2;
+		for (unsigned k = 0; k < keyframes; ++k) {
+			keyframe_report(k + 1, keyframe_acquire(pipeline, k));
+			keyframe_release(pipeline, k);
+		}
+		keyframe_stop(pipeline);
+		mandelbrot_end(globals);
+		mandelbrot_assemble(output, log, width, height, iterations, real, imag, zoom, prec, ezoom, frames, framerate, options, video);
+		return;
+	}
 
-		mandelbrot(globals);
+	// Every output is synthesized from the same keyframes, which are 
+	// rendered for the largest one and downsampled as far as the 
+	// smallest one reads them. Outputs with another framerate have as 
+	// many frames as make up the same duration 
+	std::vector<VideoOutput> outputs{VideoOutput{output, width, height, framerate, video.crf}};
+	outputs.insert(outputs.end(), video.extra_outputs.begin(), video.extra_outputs.end());
+	unsigned keyframe_width = width, keyframe_height = height, min_width = width, min_height = height;
+	for (const VideoOutput& spec : outputs) {
+		if ((unsigned long long)spec.width * height != (unsigned long long)spec.height * width)
+			fatal_error("Output '%s' is %ux%u, which has another aspect ratio than %ux%u", spec.path.c_str(), spec.width, spec.height, width, height);
+		if (spec.width > keyframe_width) {
+			keyframe_width = spec.width;
+			keyframe_height = spec.height;
+		}
+		if (spec.width < min_width) {
+			min_width = spec.width;
+			min_height = spec.height;
+		}
+	}
+	std::vector<VideoStream> streams(outputs.size());
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		VideoStream& stream = streams[i];
+		stream.output = outputs[i];
+		stream.frames = i == 0 ? frames : (unsigned)std::max(1l, std::lround((double)frames * outputs[i].framerate / framerate));
+		stream.frameno = 0;
+	}
 
-		auto end = std::chrono::high_resolution_clock::now();
-		std::chrono::duration<double> duration = end - start;
-		printf("\033[2J\033[HKeyframe 1 done rendering! %.3fs\n", duration.count());
+	// Initialize the MandelbrotGlobals, and start rendering keyframes 
+	// in the background. Frame synthesis and the keyframe renderer 
+	// share the threads of the machine: while frames are synthesized 
+	// and keyframes are left to render, each gets half of them, and 
+	// the renderer gets all of them while frame synthesis waits for 
+	// its next keyframe (from its next parallel region on) 
+	const double ratio = options.keyframe_ratio;
+	const unsigned threads = std::max(omp_get_max_threads(), 1);
+	mandelbrot_start(globals, nullptr, frame_keyframe_size(keyframe_width, ratio), frame_keyframe_size(keyframe_height, ratio), iterations, real, imag, zoom, prec, ezoom, options);
+	globals.threads = threads;
+	KeyframePipeline pipeline;
+	if (!options.keyframe_cache.empty()) {
+		pipeline.cache = keyframe_cache_directory(options.keyframe_cache, real, imag, zoom, prec, iterations, options.min_iterations);
+		keyframe_cache_manifest(pipeline.cache, keyframe_width, keyframe_height, ratio, options.foveated_keyframes);
+	}
+	size_t output_bytes = 0, pipe_bytes = 0;
+	for (const VideoOutput& spec : outputs) {
+		output_bytes += frame_bytes(spec.width, spec.height, video_format(options, spec));
+		pipe_bytes += video_pipe_bytes(options, spec);
 	}
+	const size_t encoder_bytes = ENCODER_BATCHES * output_bytes + pipe_bytes;
+	if (options.memory_budget != 0 && options.memory_budget <= encoder_bytes)
+		fatal_error("Option '--memory-budget' must leave room for %u frames of every output and the frames in its pipe, which take %zu MB", 
+			ENCODER_BATCHES, (encoder_bytes + ((size_t)1 << 20) - 1) >> 20);
+	keyframe_start(pipeline, globals, keyframe_width, keyframe_height, min_width, min_height, options.keyframe_buffers, 
+		options.memory_budget != 0 ? options.memory_budget - encoder_bytes : 0);
 
-	// Temporary multiprecision variables 
-	mpfr_t temp0, temp1;
-	mpfr_inits2(globals.precision, temp0, temp1, 0);
+	// Give every output an encoder with frame buffers for two batches of 
+	// frames, in the memory the keyframes leave 
+	const FrameKeyframe& layout = pipeline.slots[0].keyframe;
+	const size_t held = pipeline.slots.size() * frame_keyframe_bytes(layout) + KEYFRAME_SAMPLE_BYTES * (size_t)layout.width * layout.height + pipe_bytes;
+	const unsigned buffers = video_frame_buffers(options, output_bytes, held);
+	std::vector<const FrameFilter*> batch(buffers);
+	for (VideoStream& stream : streams)
+		video_start(stream.encoder, stream.pipe, stream.output, video_format(options, stream.output), ENCODER_BATCHES * buffers);
+
+	// Wait for the first keyframe 
+	const KeyframeSlot* keyframe0 = &keyframe_acquire(pipeline, 0);
+	keyframe_report(1, *keyframe0);
+
+	// The multiplier of the frame being generated of every output (the 
+	// renderer owns the one of the globals)
+	for (VideoStream& stream : streams) {
+		mpfr_init2(stream.multiplier, globals.precision);
+		mpfr_set(stream.multiplier, globals.start_multiplier, MPFR_RNDN);
+	}
 
 	// Generate keyframes and zoom into them until half multiplier is reached,
 	// then generate yet another one 
-	unsigned frameno = 0, keyframeno = 1, oldframeno = 0;
-	while (frameno < frames) {
-		// Render keyframe image and time it 
-		auto start0 = std::chrono::high_resolution_clock::now();
-		{
-			memcpy(keyframe0, keyframe1, width * height * 12);
-			mpfr_set(temp0, globals.multiplier, MPFR_RNDN);
-			mpfr_set(globals.multiplier, globals.half_keyframe_multiplier, MPFR_RNDN);
-			mandelbrot(globals);
-			mpfr_set(globals.multiplier, temp0, MPFR_RNDN);
-		}
-		auto end0 = std::chrono::high_resolution_clock::now();
-		std::chrono::duration<double> duration0 = end0 - start0;
-		printf("\033[2J\033[HKeyframe %d done rendering! %.3fs\n", ++keyframeno, duration0.count());
+	unsigned keyframeno = 1;
+	while (std::any_of(streams.begin(), streams.end(), [](const VideoStream& stream) { return stream.frameno < stream.frames; })) {
+		// Wait for the next keyframe, which was rendered while frames 
+		// were generated from the previous ones 
+		const KeyframeSlot* keyframe1 = &keyframe_acquire(pipeline, keyframeno);
+		keyframe_report(++keyframeno, *keyframe1);
 
 		// Generate frames and time them 
 		auto start1 = std::chrono::high_resolution_clock::now();
+		const unsigned oldframeno = streams[0].frameno;
+		unsigned long long hits = 0, misses = 0;
 		{
-			// While the frame can be scaled down from the keyframe 
-			for (oldframeno = frameno; mpfr_cmp(globals.multiplier, globals.half_keyframe_multiplier) > 0 && frameno < frames; ++frameno) {
-				// Calculate the zoom-in amount, 0 < Z0 ≤ 1, with respect to the keyframe 
-				mpfr_div(temp0, globals.multiplier, globals.keyframe_multiplier, MPFR_RNDN);
-				const double Z0 = mpfr_get_d(temp0, MPFR_RNDN);
-
-				// Run frame calculations 
-				calculate_frame(Z0, width, height, frame_raw, keyframe0, keyframe1);
-
-				// Adjust multiplier 
-				const double ratio = (double)(frameno + 1) / (frames - 1);
-				mpfr_div(temp0, globals.end_multiplier, globals.start_multiplier, MPFR_RNDN);
-				mpfr_set_d(temp1, ratio, MPFR_RNDN);
-				mpfr_pow(temp0, temp0, temp1, MPFR_RNDN);
-				mpfr_mul(globals.multiplier, temp0, globals.start_multiplier, MPFR_RNDN);
-
-				// Transfer all precise pixel data to the frame buffer 
-				unsigned i = 0;
-				for (; i < width * height * 3; i += 16) {
-					__m128i xmm0 = _mm256_cvtpd_epi32(_mm256_load_pd(frame_raw + (i + 0)));
-					__m128i xmm1 = _mm256_cvtpd_epi32(_mm256_load_pd(frame_raw + (i + 4)));
-					__m128i xmm2 = _mm256_cvtpd_epi32(_mm256_load_pd(frame_raw + (i + 8)));
-					__m128i xmm3 = _mm256_cvtpd_epi32(_mm256_load_pd(frame_raw + (i + 12)));
-					__m128i xmm01 = _mm_packus_epi32(xmm0, xmm1);
-					__m128i xmm23 = _mm_packus_epi32(xmm2, xmm3);
-					__m128i xmm0123 = _mm_packus_epi16(xmm01, xmm23);
-					_mm_store_si128((__m128i*)(frame + i), xmm0123);
-				}
-				for (i -= 16; i < width * height * 3; ++i)
-					frame[i] = (unsigned char)frame_raw[i];
-				
-				// Relay all of the absorbed pixel data to ffmpeg 
-				fprintf(pipe, "P6 %d %d 255 ", width, height);
-				fwrite(frame, 1, width * height * 3, pipe);
+			const unsigned synthesis = keyframe_rendering(pipeline) ? std::max(threads / 2, 1u) : threads;
+			globals.threads = std::max(threads - synthesis, 1u);
+			for (VideoStream& stream : streams) {
+				video_frames(stream, globals, keyframe0->keyframe, keyframe1->keyframe, batch, synthesis);
+				hits += stream.filters.hits;
+				misses += stream.filters.misses;
 			}
+			globals.threads = threads;
 
 			// Adjust keyframe multipliers 
-			mpfr_mul_d(globals.keyframe_multiplier, globals.keyframe_multiplier, 0.5, MPFR_RNDN);
-			mpfr_mul_d(globals.half_keyframe_multiplier, globals.half_keyframe_multiplier, 0.5, MPFR_RNDN);
+			mpfr_div_d(globals.keyframe_multiplier, globals.keyframe_multiplier, ratio, MPFR_RNDN);
+			mpfr_div_d(globals.half_keyframe_multiplier, globals.half_keyframe_multiplier, ratio, MPFR_RNDN);
+
+			// Rotate the keyframes, handing the older one's buffer back 
+			keyframe_release(pipeline, keyframeno - 2);
+			keyframe0 = keyframe1;
 		}
 		auto end1 = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<double, std::ratio<1, 1>> duration1 = end1 - start1;
-		printf("Frames %d-%d done rendering! %.3fs\n", oldframeno, frameno, duration1.count());
+		printf("Frames %d-%d done rendering! %.3fs (%.1f%% of frame filters reused)\n", oldframeno, streams[0].frameno, duration1.count(),
+			   100.0 * hits / std::max(hits + misses, 1ull));
+		encoder_report(streams[0].encoder);
 	}
 
-	// Close the pipe 
-	_pclose(pipe);
+	// Close the pipes once every frame is written, and free the renderer 
+	for (VideoStream& stream : streams) {
+		video_stop(stream.encoder, stream.output);
+		mpfr_clear(stream.multiplier);
+	}
+	keyframe_stop(pipeline);
+	mandelbrot_end(globals);
+}
+
+/*
+	A keyframe read from the cache by the assemble step.
+*/
+struct AssembledKeyframe {
+	FrameKeyframe keyframe;				/* keyframe pixels */
+	unsigned index = ~0u;				/* which keyframe it holds (~0 for none) */
+};
+
+/*
+	Read keyframe k from the cache into one of two buffers, unless it 
+	is already there, building its levels on `threads` threads, and 
+	log how long that took. Frames use keyframes k and k + 1, which are 
+	in different buffers.
+*/
+static const FrameKeyframe& assemble_keyframe(AssembledKeyframe* keyframes, const std::string& directory, unsigned k, bool log, unsigned threads) {
+	AssembledKeyframe& slot = keyframes[k % 2];
+	if (slot.index == k)
+		return slot.keyframe;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	if (!frame_keyframe_load(slot.keyframe, keyframe_cache_path(directory, k).c_str(), threads))
+		fatal_error("Keyframe %u of this zoom is not in the keyframe cache '%s'", k + 1, directory.c_str());
+	auto end = std::chrono::high_resolution_clock::now();
+	if (log)
+		printf("\033[2J\033[HKeyframe %u loaded from the keyframe cache! %.3fs\n", k + 1, std::chrono::duration<double>(end - start).count());
+	slot.index = k;
+	return slot.keyframe;
+}
+
+/*
+	A contiguous part of a video the assemble step encodes on its own, 
+	with its own ffmpeg and keyframes.
+*/
+struct AssembledSegment {
+	VideoOutput output;					/* file the segment is encoded to */
+	unsigned frameno;					/* next frame to generate */
+	unsigned end;						/* frame after its last */
+	EncoderPipe pipe;					/* pipe to ffmpeg */
+	Encoder encoder;					/* writer of its frames to the pipe */
+	AssembledKeyframe keyframes[2];		/* keyframes its frames are synthesized from */
+};
+
+/*
+	Split `frames` frames into `count` contiguous segments of about the 
+	same length, and return the frame each ends before. Segments end 
+	where frames move to the next keyframe interval (as given by 
+	`interval`), so that no two read the same keyframes, except where 
+	there are too few intervals. Empty segments are dropped.
+*/
+template <typename Interval>
+static std::vector<unsigned> assemble_segments(unsigned frames, unsigned count, Interval interval) {
+	std::vector<unsigned> boundaries;
+	for (unsigned f = 1; f < frames; ++f)
+		if (interval(f) != interval(f - 1))
+			boundaries.push_back(f);
+
+	std::vector<unsigned> ends;
+	for (unsigned s = 1; s < count; ++s) {
+		// Snap to the nearest boundary 
+		unsigned end = (unsigned)((unsigned long long)frames * s / count);
+		auto next = std::lower_bound(boundaries.begin(), boundaries.end(), end);
+		if (next != boundaries.end() && (next == boundaries.begin() || *next - end <= end - next[-1]))
+			end = *next;
+		else if (next != boundaries.begin())
+			end = next[-1];
+		if (end != 0 && end < frames && (ends.empty() || ends.back() < end))
+			ends.push_back(end);
+	}
+	ends.push_back(frames);
+	return ends;
+}
+
+void mandelbrot_assemble(
+	std::string output,
+	bool log,
+	unsigned width,
+	unsigned height,
+	unsigned iterations,
+	const char* real,
+	const char* imag,
+	const char* zoom,
+	unsigned prec,
+	const char* ezoom,
+	unsigned frames,
+	unsigned framerate,
+	const MandelbrotOptions& options,
+	const VideoOptions& video 
+) {
+	// Find how the cached keyframes were laid out. Frames of another 
+	// resolution read them from other levels, but must show the same 
+	// view 
+	const std::string directory = keyframe_cache_directory(options.keyframe_cache, real, imag, zoom, prec, iterations, options.min_iterations);
+	const std::string manifest = (std::filesystem::path(directory) / "keyframes.txt").string();
+	unsigned cached_width, cached_height;
+	double ratio;
+	int foveated;
+	FILE* file = fopen(manifest.c_str(), "r");
+	if (file == NULL)
+		fatal_error("No keyframes of this zoom are in the keyframe cache '%s'", options.keyframe_cache.c_str());
+	const bool read = fscanf(file, "%u %u %lf %d", &cached_width, &cached_height, &ratio, &foveated) == 4;
+	fclose(file);
+	if (!read)
+		fatal_error("Failed reading keyframe cache file '%s'", manifest.c_str());
+	if ((unsigned long long)width * cached_height != (unsigned long long)height * cached_width)
+		fatal_error("Cached keyframes are for %ux%u frames, which have another aspect ratio than %ux%u", cached_width, cached_height, width, height);
+
+	// Frame f is log(ezoom / zoom) f / (frames - 1) deep, in units of 
+	// log(ratio), which is a keyframe k and a zoom-in amount Z0 into it. 
+	// Frames are written in reverse when zooming out 
+	const double keyframe_depth = video_keyframe_depth(zoom, ezoom, prec, ratio);
+	auto position = [&](unsigned frameno) {
+		const unsigned f = options.zoom_out ? frames - 1 - frameno : frameno;
+		return frames > 1 ? keyframe_depth * f / (frames - 1) : 0.0;
+	};
+	auto interval = [&](unsigned frameno) { return (unsigned)std::max(std::floor(position(frameno)), 0.0); };
+
+	// Image sequences are already written by several threads 
+	const unsigned count = encoder_sequence(output) ? 1 : std::max(options.segments, 1u);
+	const std::vector<unsigned> ends = assemble_segments(frames, count, interval);
+	std::vector<AssembledSegment> segments(ends.size());
+	std::vector<std::string> paths;
+	for (unsigned s = 0; s < segments.size(); ++s) {
+		AssembledSegment& segment = segments[s];
+		segment.output = {segments.size() > 1 ? video_segment_path(output, s) : output, width, height, framerate, video.crf};
+		segment.frameno = s != 0 ? ends[s - 1] : 0;
+		segment.end = ends[s];
+		paths.push_back(segment.output.path);
+		for (AssembledKeyframe& slot : segment.keyframes) {
+			frame_keyframe_start(slot.keyframe, cached_width, cached_height, ratio, foveated != 0);
+			frame_keyframe_levels(slot.keyframe, width, height, ratio);
+		}
+	}
+
+	// Nothing renders next to assembly, so it synthesizes frames on 
+	// every thread, as a video does while no keyframes are left 
+	const FrameFormat format = video_format(options, segments[0].output);
+	const unsigned threads = std::max(omp_get_max_threads(), 1);
+	const unsigned buffers = video_frame_buffers(options, segments.size() * frame_bytes(width, height, format), 
+		segments.size() * (2 * frame_keyframe_bytes(segments[0].keyframes[0].keyframe) + video_pipe_bytes(options, segments[0].output)));
+	for (AssembledSegment& segment : segments)
+		video_start(segment.encoder, segment.pipe, segment.output, format, ENCODER_BATCHES * buffers);
+	std::vector<const FrameFilter*> batch(buffers);
+	FrameFilterCache filters;
+
+	// Segments take turns synthesizing a batch of frames, so that every 
+	// encoder has frames to encode at once. Frames are batched as long 
+	// as they share their keyframes 
+	for (bool done = false; !done;) {
+		done = true;
+		for (AssembledSegment& segment : segments) {
+			if (segment.frameno == segment.end)
+				continue;
+			const unsigned frameno = segment.frameno;
+			auto start = std::chrono::high_resolution_clock::now();
+			unsigned count = 0;
+			const unsigned k = interval(frameno);
+			for (; count < buffers && frameno + count < segment.end && interval(frameno + count) == k; ++count) {
+				const double Z0 = std::pow(ratio, k - position(frameno + count));
+				batch[count] = &frame_filter(filters, Z0, ratio, width, height, segment.keyframes[0].keyframe);
+			}
+			const FrameKeyframe& keyframe0 = assemble_keyframe(segment.keyframes, directory, k, log, threads);
+			const FrameKeyframe& keyframe1 = assemble_keyframe(segment.keyframes, directory, k + 1, log, threads);
+
+			video_batch(segment.encoder, batch, count, keyframe0, keyframe1, threads);
+			auto end = std::chrono::high_resolution_clock::now();
+			if (log) {
+				printf("Frames %d-%d done assembling! %.3fs\n", frameno, frameno + count, std::chrono::duration<double>(end - start).count());
+				encoder_report(segment.encoder);
+			}
+			segment.frameno += count;
+			done = done && segment.frameno == segment.end;
+		}
+	}
+
+	// Close the pipes once every frame is written, free the keyframes, 
+	// and join the segments 
+	for (AssembledSegment& segment : segments) {
+		video_stop(segment.encoder, segment.output);
+		for (AssembledKeyframe& slot : segment.keyframes)
+			frame_keyframe_end(slot.keyframe);
+	}
+	if (segments.size() > 1)
+		video_concat(output, paths);
 }
\ No newline at end of file
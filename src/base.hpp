@@ -6,8 +6,40 @@
  */
 #pragma once
 #include "./datatypes.hpp"
+#include "./mandelbrot.hpp"
+#include "./encoder.hpp"
 #include <string>
 
+/*
+	With --min-iters, the iteration limit of a video keyframe is this 
+	many times the latest iteration a pixel of the previous keyframe 
+	escaped at, so that the boundary, which escapes later as the zoom 
+	goes deeper, stays resolved.
+*/
+#define KEYFRAME_ITERATION_HEADROOM 2.0
+
+/*
+	Fraction of the escaped pixels of a keyframe that may escape in the 
+	last eighth of its iteration limit before pixels that reached the 
+	limit are suspected to escape as well, and the next keyframe gets 
+	at least twice the limit.
+*/
+#define KEYFRAME_ITERATION_TAIL 0.01
+
+/*
+	Bytes an image rendered in bands within --memory-budget holds for 
+	every pixel of a band: its color, and at most a flag and an index 
+	of the renderer's bookkeeping.
+*/
+#define BAND_PIXEL_BYTES 8
+
+/*
+	Bytes the keyframe renderer holds for every sample of a keyframe 
+	next to its buffer: the mask of reused samples, and the flag and 
+	index of the renderer's bookkeeping (keyframes are not banded).
+*/
+#define KEYFRAME_SAMPLE_BYTES 6
+
 /*
 	Causes a "fatal error" that exits the program 
 	immediately.
@@ -32,7 +64,8 @@ void mandelbrot_image(
 	const char* real,
 	const char* imag,
 	const char* zoom,
-	unsigned prec 
+	unsigned prec,
+	const MandelbrotOptions& options 
 );
 
 /*
@@ -50,5 +83,30 @@ void mandelbrot_video(
 	unsigned prec,
 	const char* ezoom,
 	unsigned frames,
-	unsigned framerate 
+	unsigned framerate,
+	const MandelbrotOptions& options,
+	const VideoOptions& video 
+);
+
+/*
+	Render a video from the keyframes of a zoom in the keyframe cache, 
+	without rendering any. The frame count, framerate, resolution (of 
+	the same aspect ratio) and direction may differ from the render 
+	that cached them. Progress is only printed with `log`.
+*/
+void mandelbrot_assemble(
+	std::string output,
+	bool log,
+	unsigned width,
+	unsigned height,
+	unsigned iterations,
+	const char* real,
+	const char* imag,
+	const char* zoom,
+	unsigned prec,
+	const char* ezoom,
+	unsigned frames,
+	unsigned framerate,
+	const MandelbrotOptions& options,
+	const VideoOptions& video 
 );
\ No newline at end of file
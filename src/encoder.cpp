@@ -0,0 +1,405 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#include "./encoder.hpp"
+#include "./image.hpp"
+#include "./base.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstring>
+#include <new>
+#if !defined(_WIN32)
+#include <cerrno>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+extern char** environ;
+#endif
+
+EncoderPipe encoder_pipe_open(const std::vector<std::string>& arguments) {
+	EncoderPipe pipe;
+	pipe.written = 0;
+#if defined(_WIN32)
+	// cmd.exe splits arguments on more than spaces, so quote those that 
+	// are not plain words or paths
+	std::string command;
+	for (const std::string& argument : arguments) {
+		const bool plain = !argument.empty() && std::all_of(argument.begin(), argument.end(), [](char c) {
+			return isalnum((unsigned char)c) || strchr("+-_./\\:", c) != nullptr;
+		});
+		command += plain ? argument : "\"" + argument + "\"";
+		command += ' ';
+	}
+	command += "> NUL 2>&1";
+	pipe.file = _popen(command.c_str(), "wb");
+
+	// If Windows failed to open the pipe, report that error
+	if (pipe.file == NULL)
+		fatal_error("Failed opening pipe (Windows error)\n");
+#else
+	// ffmpeg reads the pipe as its standard input. Neither end is 
+	// inherited by the ffmpeg of another output, which would keep it 
+	// open
+	int ends[2];
+	if (::pipe(ends) != 0)
+		fatal_error("Failed opening pipe (%s)", strerror(errno));
+	fcntl(ends[0], F_SETFD, FD_CLOEXEC);
+	fcntl(ends[1], F_SETFD, FD_CLOEXEC);
+	#if defined(F_SETPIPE_SZ)
+	fcntl(ends[1], F_SETPIPE_SZ, ENCODER_PIPE_SIZE);
+	#endif
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, ends[0], 0);
+	posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, 1, 2);
+	std::vector<char*> argv;
+	for (const std::string& argument : arguments)
+		argv.push_back(const_cast<char*>(argument.c_str()));
+	argv.push_back(nullptr);
+	const int error = posix_spawnp(&pipe.process, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(ends[0]);
+	if (error != 0)
+		fatal_error("Failed starting %s (%s)", argv[0], strerror(error));
+	pipe.fd = ends[1];
+#endif
+	return pipe;
+}
+
+void encoder_pipe_write(EncoderPipe& pipe, const void* data, size_t bytes) {
+	pipe.written += bytes;
+#if defined(_WIN32)
+	fwrite(data, 1, bytes, pipe.file);
+#else
+	const char* next = (const char*)data;
+	while (bytes > 0) {
+		const ssize_t done = write(pipe.fd, next, bytes);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0)
+			fatal_error("Failed writing to ffmpeg (%s)", strerror(errno));
+		next += done;
+		bytes -= done;
+	}
+#endif
+}
+
+void encoder_pipe_splice(EncoderPipe& pipe, const void* data, size_t bytes) {
+#if defined(__linux__)
+	// vmsplice may take fewer pages than it is given when the pipe is 
+	// full, after it waited for ffmpeg to read some
+	pipe.written += bytes;
+	iovec pages{const_cast<void*>(data), bytes};
+	while (pages.iov_len > 0) {
+		const ssize_t done = vmsplice(pipe.fd, &pages, 1, 0);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0)
+			fatal_error("Failed writing to ffmpeg (%s)", strerror(errno));
+		pages.iov_base = (char*)pages.iov_base + done;
+		pages.iov_len -= done;
+	}
+#else
+	encoder_pipe_write(pipe, data, bytes);
+#endif
+}
+
+size_t encoder_pipe_read(const EncoderPipe& pipe) {
+#if defined(__linux__)
+	// The pipe holds whatever was written but not read yet
+	int pending = 0;
+	if (ioctl(pipe.fd, FIONREAD, &pending) == 0)
+		return pipe.written - pending;
+#endif
+	return pipe.written;
+}
+
+void encoder_pipe_wait(const EncoderPipe& pipe) {
+#if defined(__linux__)
+	// A full pipe turns writable once ffmpeg reads a page of it 
+	pollfd writable{pipe.fd, POLLOUT, 0};
+	while (poll(&writable, 1, -1) < 0 && errno == EINTR);
+#endif
+}
+
+bool encoder_pipe_close(EncoderPipe& pipe) {
+#if defined(_WIN32)
+	return _pclose(pipe.file) == 0;
+#else
+	close(pipe.fd);
+	int status;
+	pid_t done;
+	while ((done = waitpid(pipe.process, &status, 0)) < 0 && errno == EINTR);
+	return done == pipe.process && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+/*
+	Bytes a frame buffer of the given resolution and format takes in 
+	the pool.
+*/
+static size_t encoder_stride(unsigned width, unsigned height, FrameFormat format) {
+	const size_t bytes = frame_bytes(width, height, format);
+	return (bytes + ENCODER_PAGE_SIZE - 1) / ENCODER_PAGE_SIZE * ENCODER_PAGE_SIZE;
+}
+
+size_t encoder_pipe_bytes(unsigned width, unsigned height, FrameFormat format) {
+#if defined(__linux__)
+	// Enough buffers to fill the pipe, and one more that ffmpeg is 
+	// partway through reading 
+	const size_t stride = encoder_stride(width, height, format);
+	return ((ENCODER_PIPE_SIZE + stride - 1) / stride + 1) * stride;
+#else
+	return 0;
+#endif
+}
+
+/*
+	Free the buffers of every written frame ffmpeg has read. The mutex
+	must be held.
+*/
+static void encoder_reclaim(Encoder& encoder) {
+	const size_t read = encoder_pipe_read(*encoder.pipe);
+	bool freed = false;
+	while (!encoder.piped.empty() && encoder.piped.front().second <= read) {
+		encoder.free.push_back(encoder.piped.front().first);
+		encoder.piped.pop_front();
+		freed = true;
+	}
+	if (freed)
+		encoder.condition.notify_all();
+}
+
+/*
+	Body of the writer of a pipe. When a buffer is asked for while 
+	every one is in the pipe, the writer waits for ffmpeg to read it.
+*/
+static void encoder_write(Encoder& encoder) {
+	const size_t bytes = frame_bytes(encoder.width, encoder.height, encoder.format);
+	char header[64];
+	const int header_bytes = encoder.format == FrameFormat::Rgb ?
+		snprintf(header, sizeof(header), "P6 %d %d 255 ", encoder.width, encoder.height) :
+		snprintf(header, sizeof(header), "FRAME\n");
+	while (true) {
+		unsigned char* frame;
+		{
+			std::unique_lock<std::mutex> lock(encoder.mutex);
+			encoder.condition.wait(lock, [&] {
+				return !encoder.queue.empty() || encoder.stopped || (encoder.waiting != 0 && encoder.free.empty() && !encoder.piped.empty());
+			});
+
+			// Frames left in the pipe once stopped are read before 
+			// ffmpeg exits, which encoder_stop waits for 
+			if (encoder.queue.empty()) {
+				if (encoder.stopped)
+					return;
+				encoder_reclaim(encoder);
+				if (encoder.free.empty()) {
+					lock.unlock();
+					encoder_pipe_wait(*encoder.pipe);
+					lock.lock();
+					encoder_reclaim(encoder);
+				}
+				continue;
+			}
+			frame = encoder.queue.front();
+			encoder.queue.pop_front();
+			++encoder.writing;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		encoder_pipe_write(*encoder.pipe, header, header_bytes);
+		encoder_pipe_splice(*encoder.pipe, frame, bytes);
+		auto end = std::chrono::high_resolution_clock::now();
+
+		std::lock_guard<std::mutex> lock(encoder.mutex);
+		--encoder.writing;
+		encoder.piped.emplace_back(frame, encoder.pipe->written);
+		encoder_reclaim(encoder);
+		encoder.stats.write_seconds += std::chrono::duration<double>(end - start).count();
+		encoder.condition.notify_all();
+	}
+}
+
+/*
+	Split the pattern of an image sequence around its %d or %0Nd, 
+	with the number of digits numbers are padded to. Returns false 
+	if it has no such conversion, or another %.
+*/
+static bool encoder_pattern(const std::string& pattern, std::string& prefix, unsigned& digits, std::string& suffix) {
+	const size_t percent = pattern.find('%');
+	if (percent == std::string::npos || pattern.find('%', percent + 1) != std::string::npos)
+		return false;
+	size_t end = percent + 1;
+	if (end < pattern.size() && pattern[end] == '0')
+		++end;
+	digits = 0;
+	while (end < pattern.size() && isdigit((unsigned char)pattern[end]) && digits < 100)
+		digits = 10 * digits + (pattern[end++] - '0');
+	if (end == pattern.size() || pattern[end] != 'd' || (digits != 0 && pattern[percent + 1] != '0'))
+		return false;
+	prefix = pattern.substr(0, percent);
+	suffix = pattern.substr(end + 1);
+	return true;
+}
+
+bool encoder_sequence(const std::string& path) {
+	return path.find('%') != std::string::npos;
+}
+
+/*
+	Body of a writer of an image sequence, which encodes and writes a 
+	frame at a time.
+*/
+static void encoder_write_sequence(Encoder& encoder) {
+	std::string prefix, suffix;
+	unsigned digits;
+	encoder_pattern(encoder.pattern, prefix, digits, suffix);
+	while (true) {
+		unsigned char* frame;
+		unsigned long long number;
+		{
+			std::unique_lock<std::mutex> lock(encoder.mutex);
+			encoder.condition.wait(lock, [&] { return encoder.stopped || !encoder.queue.empty(); });
+			if (encoder.queue.empty())
+				return;
+			frame = encoder.queue.front();
+			encoder.queue.pop_front();
+			number = ++encoder.numbered;
+			++encoder.writing;
+		}
+
+		// Frames are compressed by the writers in parallel, rather than 
+		// each with several threads 
+		auto start = std::chrono::high_resolution_clock::now();
+		std::string path = std::to_string(number);
+		path = prefix + std::string(path.size() < digits ? digits - path.size() : 0, '0') + path + suffix;
+		ImageWriter writer;
+		image_start(writer, path, encoder.width, encoder.height, 1);
+		image_write(writer, frame, encoder.height);
+		image_end(writer);
+		auto end = std::chrono::high_resolution_clock::now();
+
+		std::lock_guard<std::mutex> lock(encoder.mutex);
+		--encoder.writing;
+		encoder.free.push_back(frame);
+		encoder.stats.write_seconds += std::chrono::duration<double>(end - start).count();
+		encoder.condition.notify_all();
+	}
+}
+
+/*
+	Allocate the frame buffers of an encoder, page-aligned, and reset 
+	its state.
+*/
+static void encoder_buffers(Encoder& encoder, unsigned buffers) {
+	const size_t stride = encoder_stride(encoder.width, encoder.height, encoder.format);
+	encoder.pool = new (std::align_val_t(ENCODER_PAGE_SIZE)) unsigned char[buffers * stride];
+	encoder.free.clear();
+	for (unsigned i = 0; i < buffers; ++i)
+		encoder.free.push_back(encoder.pool + i * stride);
+	encoder.queue.clear();
+	encoder.piped.clear();
+	encoder.writing = 0;
+	encoder.waiting = 0;
+	encoder.numbered = 0;
+	encoder.stopped = false;
+	encoder.stats = EncoderStats{};
+	encoder.writers.clear();
+}
+
+void encoder_start(Encoder& encoder, EncoderPipe& pipe, unsigned width, unsigned height, unsigned framerate, FrameFormat format, unsigned buffers) {
+	encoder.pipe = &pipe;
+	encoder.pattern.clear();
+	encoder.width = width;
+	encoder.height = height;
+	encoder.format = format;
+
+	// Frames in the pipe still hold their buffers 
+	buffers += (unsigned)(encoder_pipe_bytes(width, height, format) / encoder_stride(width, height, format));
+	encoder_buffers(encoder, buffers);
+
+	// Chroma samples are centered between the four pixels they average
+	char header[128];
+	int header_bytes = 0;
+	if (format == FrameFormat::Yuv420)
+		header_bytes = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", width, height, framerate);
+	else if (format == FrameFormat::Yuv420p10)
+		header_bytes = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420p10 XYSCSS=420P10\n", width, height, framerate);
+	encoder_pipe_write(pipe, header, header_bytes);
+	encoder.writers.emplace_back(encoder_write, std::ref(encoder));
+}
+
+void encoder_start_sequence(Encoder& encoder, const std::string& pattern, unsigned width, unsigned height, unsigned buffers) {
+	std::string prefix, suffix;
+	unsigned digits;
+	if (!encoder_pattern(pattern, prefix, digits, suffix) || image_format(pattern) == ImageFormat::Ffmpeg)
+		fatal_error("Unrecognized image sequence '%s', sequences are paths with one %%d or %%0Nd, ending in '.ppm', '.qoi' or '.png'", pattern.c_str());
+	encoder.pipe = nullptr;
+	encoder.pattern = pattern;
+	encoder.width = width;
+	encoder.height = height;
+	encoder.format = FrameFormat::Rgb;
+	encoder_buffers(encoder, buffers);
+	for (unsigned i = 0; i < ENCODER_SEQUENCE_WRITERS; ++i)
+		encoder.writers.emplace_back(encoder_write_sequence, std::ref(encoder));
+}
+
+unsigned char* encoder_acquire(Encoder& encoder) {
+	std::unique_lock<std::mutex> lock(encoder.mutex);
+	if (encoder.free.empty()) {
+		auto start = std::chrono::high_resolution_clock::now();
+		++encoder.waiting;
+		encoder.condition.notify_all();
+		encoder.condition.wait(lock, [&] { return !encoder.free.empty(); });
+		--encoder.waiting;
+		auto end = std::chrono::high_resolution_clock::now();
+		encoder.stats.wait_seconds += std::chrono::duration<double>(end - start).count();
+	}
+	unsigned char* frame = encoder.free.back();
+	encoder.free.pop_back();
+	return frame;
+}
+
+void encoder_submit(Encoder& encoder, unsigned char* frame) {
+	std::lock_guard<std::mutex> lock(encoder.mutex);
+	encoder.queue.push_back(frame);
+	++encoder.stats.frames;
+	const unsigned depth = encoder.queue.size() + encoder.writing;
+	encoder.stats.depth += depth;
+	encoder.stats.max_depth = std::max(encoder.stats.max_depth, depth);
+	encoder.condition.notify_all();
+}
+
+EncoderStats encoder_stats(Encoder& encoder) {
+	std::lock_guard<std::mutex> lock(encoder.mutex);
+	const EncoderStats stats = encoder.stats;
+	encoder.stats = EncoderStats{};
+	return stats;
+}
+
+bool encoder_stop(Encoder& encoder) {
+	{
+		std::lock_guard<std::mutex> lock(encoder.mutex);
+		encoder.stopped = true;
+		encoder.condition.notify_all();
+	}
+	for (std::thread& writer : encoder.writers)
+		writer.join();
+	const bool encoded = encoder.pipe == nullptr || encoder_pipe_close(*encoder.pipe);
+	operator delete[](encoder.pool, std::align_val_t(ENCODER_PAGE_SIZE));
+	encoder.free.clear();
+	encoder.piped.clear();
+	return encoded;
+}
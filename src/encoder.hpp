@@ -0,0 +1,212 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#pragma once
+#include "frame.hpp"
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#if !defined(_WIN32)
+#include <sys/types.h>
+#endif
+
+/*
+	Number of batches of frames an encoder has buffers for. While one
+	batch is synthesized, the frames of the previous one are written.
+*/
+#define ENCODER_BATCHES 2
+
+/*
+	Bytes the pipe to ffmpeg is enlarged to, where the platform allows 
+	it. On Linux, frames stay in their buffers until ffmpeg reads them, 
+	so encoders keep enough extra buffers to fill the pipe.
+*/
+#define ENCODER_PIPE_SIZE (1 << 20)
+
+/*
+	Frame buffers are aligned and padded to pages, so that no page of 
+	a frame in the pipe is shared with another frame.
+*/
+#define ENCODER_PAGE_SIZE 4096
+
+/*
+	Number of threads that encode and write the frames of an image 
+	sequence, each a frame at a time, so that a slow disk or encoder 
+	does not hold up synthesis.
+*/
+#define ENCODER_SEQUENCE_WRITERS 4
+
+/*
+	A file a video is encoded to. Other outputs than the main one are 
+	encoded from the same keyframes, at their own resolution (of the 
+	same aspect ratio) and framerate (over the same duration).
+*/
+struct VideoOutput {
+	std::string path;					/* output file */
+	unsigned width, height;				/* resolution */
+	unsigned framerate;					/* framerate */
+	unsigned crf;						/* x264 constant rate factor */
+};
+
+/*
+	How a video is encoded, next to its main output.
+*/
+struct VideoOptions {
+	unsigned crf = 18;						/* x264 constant rate factor of the main output */
+	std::vector<VideoOutput> extra_outputs;	/* other outputs encoded from the same keyframes */
+};
+
+/*
+	A pipe to a running ffmpeg. On Windows, ffmpeg is started with 
+	_popen and written to through stdio. Elsewhere it is started with 
+	posix_spawn, and on Linux frames are written with vmsplice, which 
+	hands their pages to the pipe instead of copying them.
+*/
+struct EncoderPipe {
+#if defined(_WIN32)
+	FILE* file;							/* stdio stream of the pipe */
+#else
+	int fd;								/* write end of the pipe */
+	pid_t process;						/* ffmpeg */
+#endif
+	size_t written;						/* bytes written to the pipe */
+};
+
+/*
+	How an encoder kept up with the frames given to it. When synthesis
+	waits for buffers, ffmpeg is the bottleneck; when the queue is
+	mostly empty, synthesis is.
+*/
+struct EncoderStats {
+	unsigned long long frames;			/* frames submitted */
+	unsigned long long depth;			/* sum of the queue depth after every submission */
+	unsigned max_depth;					/* deepest the queue got */
+	double write_seconds;				/* time the writers spent writing frames */
+	double wait_seconds;				/* time spent waiting for a free buffer */
+};
+
+/*
+	Writes frames to an ffmpeg pipe on a background thread, so that
+	frames are synthesized while the pipe drains. Frames are written
+	in the order they are submitted, from a bounded pool of buffers.
+	RGB frames are written as a PPM stream, and YUV frames as a Y4M
+	stream. Buffers whose pages were handed to the pipe are only 
+	reused once ffmpeg has read them.
+
+	An encoder may instead write every frame to its own image file, 
+	numbered in the order frames are submitted. Those are written by 
+	ENCODER_SEQUENCE_WRITERS threads in any order.
+*/
+struct Encoder {
+	EncoderPipe* pipe;					/* pipe frames are written to (null for an image sequence) */
+	std::string pattern;				/* path of the images of a sequence, with %d for the frame number */
+	unsigned width, height;				/* frame resolution */
+	FrameFormat format;					/* frame pixel format */
+	unsigned char* pool;				/* every frame buffer, in one allocation */
+	std::vector<unsigned char*> free;	/* buffers that are not in use */
+	std::deque<unsigned char*> queue;	/* frames to write, oldest first */
+	std::deque<std::pair<unsigned char*, size_t>> piped;	/* written frames ffmpeg may not have read, with the pipe offset of their end */
+	unsigned writing;					/* frames being written */
+	unsigned waiting;					/* callers waiting for a free buffer */
+	unsigned long long numbered;		/* frames taken from the queue, which numbers images */
+	bool stopped;						/* whether the writers should exit once the queue is empty */
+	EncoderStats stats;					/* statistics since they were last read */
+	std::mutex mutex;					/* guards the members above */
+	std::condition_variable condition;	/* signalled whenever a buffer is queued or freed */
+	std::vector<std::thread> writers;	/* background threads writing frames */
+};
+
+/*
+	Start ffmpeg with the given arguments, reading from the returned 
+	pipe, with its output discarded.
+*/
+EncoderPipe encoder_pipe_open(const std::vector<std::string>& arguments);
+
+/*
+	Write bytes to a pipe, copying them.
+*/
+void encoder_pipe_write(EncoderPipe& pipe, const void* data, size_t bytes);
+
+/*
+	Write a page-aligned buffer to a pipe. Where its pages are handed 
+	to the pipe, it must not change until encoder_pipe_read passes the 
+	pipe offset of its end.
+*/
+void encoder_pipe_splice(EncoderPipe& pipe, const void* data, size_t bytes);
+
+/*
+	Bytes of the pipe ffmpeg has read. Where that cannot be told, it is 
+	every byte written, which were copied.
+*/
+size_t encoder_pipe_read(const EncoderPipe& pipe);
+
+/*
+	Wait until ffmpeg has read some of a full pipe. Returns at once 
+	where the pipe is not full, or frames are copied to it.
+*/
+void encoder_pipe_wait(const EncoderPipe& pipe);
+
+/*
+	Close a pipe, and wait for ffmpeg to finish. Returns whether it 
+	exited successfully.
+*/
+bool encoder_pipe_close(EncoderPipe& pipe);
+
+/*
+	Bytes of the frame buffers an encoder writing frames of the given 
+	resolution and format to a pipe keeps on top of the ones it is 
+	started with, to fill the pipe (none where frames are copied).
+*/
+size_t encoder_pipe_bytes(unsigned width, unsigned height, FrameFormat format);
+
+/*
+	Start writing frames of the given resolution and format to a pipe,
+	with `buffers` frame buffers (and as many more as fill the pipe, 
+	where frames stay in their buffers until ffmpeg reads them). The 
+	framerate is only written to the header of Y4M streams.
+*/
+void encoder_start(Encoder& encoder, EncoderPipe& pipe, unsigned width, unsigned height, unsigned framerate, FrameFormat format, unsigned buffers);
+
+/*
+	Whether a video output is an image sequence, whose path has a %d 
+	(or %0Nd, padded to N digits) where frame numbers go.
+*/
+bool encoder_sequence(const std::string& path);
+
+/*
+	Start writing RGB frames of the given resolution to numbered PPM, 
+	QOI or PNG images (chosen from the pattern's extension) with 
+	`buffers` frame buffers. Frames are numbered from 1.
+*/
+void encoder_start_sequence(Encoder& encoder, const std::string& pattern, unsigned width, unsigned height, unsigned buffers);
+
+/*
+	Take a free frame buffer, waiting for a writer to free one if
+	needed. May be called by several threads at once.
+*/
+unsigned char* encoder_acquire(Encoder& encoder);
+
+/*
+	Queue a frame taken with encoder_acquire to be written. Frames are
+	written in the order they are submitted.
+*/
+void encoder_submit(Encoder& encoder, unsigned char* frame);
+
+/*
+	Read the statistics since the last call, and reset them.
+*/
+EncoderStats encoder_stats(Encoder& encoder);
+
+/*
+	Write every queued frame, stop the writers, close the pipe (which 
+	waits for ffmpeg to read every frame and finish) and free the 
+	buffers. Returns whether ffmpeg exited successfully.
+*/
+bool encoder_stop(Encoder& encoder);
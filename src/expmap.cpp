@@ -0,0 +1,179 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#include "./expmap.hpp"
+#include "./frame.hpp"
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+/*
+	Row `row` of a level of the strip. The band it is in must be kept.
+*/
+MANDELBROT_INLINE static const unsigned char* expmap_row(const ExpmapStrip& strip, unsigned level, long row) {
+	const long rows = EXPMAP_BAND_ROWS >> level;
+	row = std::max(row, 0l);
+	const ExpmapBand& band = strip.bands[row / rows - strip.bands.front().index];
+	return band.levels[level] + 3 * (size_t)(row % rows) * (strip.columns >> level);
+}
+
+void expmap_start(ExpmapStrip& strip, unsigned width, unsigned height) {
+	strip.width = width;
+	strip.height = height;
+	strip.bands.clear();
+	strip.rendered = 0;
+
+	// The outer ring reaches a little past the corners, so that corner
+	// pixels interpolate between rendered rows. Pixels are no closer to
+	// the center than half a pixel, and cover the most cells there
+	strip.radius = std::hypot(0.5 * width, 0.5 * height) + 2.0;
+	const double inner = std::max(std::hypot(width % 2 ? 0.0 : 0.5, height % 2 ? 0.0 : 0.5), 0.5);
+	strip.levels = 1 + std::min(EXPMAP_LEVELS, (int)std::floor(std::log2(strip.radius / inner)));
+
+	// Cells of the outer ring are at most a pixel across, and columns
+	// halve evenly down to the last level
+	const unsigned align = 1u << (strip.levels - 1);
+	strip.columns = (unsigned)std::ceil(2.0 * M_PI * strip.radius / align) * align;
+	strip.step = 2.0 * M_PI / strip.columns;
+
+	strip.angles.resize(2 * strip.columns);
+	for (unsigned i = 0; i < strip.columns; ++i) {
+		strip.angles[2 * i + 0] = std::cos((i + 0.5) * strip.step);
+		strip.angles[2 * i + 1] = std::sin((i + 0.5) * strip.step);
+	}
+	strip.radii.resize(EXPMAP_BAND_ROWS);
+	for (unsigned j = 0; j < EXPMAP_BAND_ROWS; ++j)
+		strip.radii[j] = std::exp((EXPMAP_BAND_ROWS - 1 - j) * strip.step) / strip.step;
+
+	// A pixel at radius q covers 1 / (q step) cells along both axes, and
+	// reads the level where that is one or two. The bilinear taps of
+	// row r of level l cover the level 0 rows [2^l r, 2^l (r + 2))
+	strip.samples.resize((size_t)width * height);
+	strip.near = INFINITY;
+	strip.far = -INFINITY;
+	for (unsigned y = 0; y < height; ++y)
+		for (unsigned x = 0; x < width; ++x) {
+			const double u = x - 0.5 * width + 0.5, v = 0.5 * height - 0.5 - y;
+			const double q = std::max(std::hypot(u, v), 0.5);
+			const double footprint = 1.0 / (q * strip.step);
+			const unsigned level = footprint >= 2.0 ? std::min((unsigned)std::log2(footprint), strip.levels - 1) : 0;
+			const double scale = std::ldexp(1.0, -(int)level);
+
+			double column = std::atan2(v, u) / strip.step;
+			if (column < 0.0)
+				column += strip.columns;
+			const double row = std::log(strip.radius / q) / strip.step;
+
+			ExpmapSample& sample = strip.samples[(size_t)y * width + x];
+			sample.level = level;
+			sample.column = (float)(column * scale - 0.5);
+			sample.row = row * scale - 0.5;
+			strip.near = std::min(strip.near, (std::floor(sample.row) - 1.0) / scale - 1.0);
+			strip.far = std::max(strip.far, (std::floor(sample.row) + 3.0) / scale + 1.0);
+		}
+}
+
+MandelbrotStats expmap_render(ExpmapStrip& strip, MandelbrotGlobals& globals) {
+	ExpmapBand band;
+	band.index = strip.rendered++;
+
+	size_t bytes = 0;
+	for (unsigned l = 0; l < strip.levels; ++l)
+		bytes += 3 * (size_t)(strip.columns >> l) * (EXPMAP_BAND_ROWS >> l);
+	band.levels.resize(strip.levels);
+	band.levels[0] = new unsigned char[bytes];
+	for (unsigned l = 1; l < strip.levels; ++l)
+		band.levels[l] = band.levels[l - 1] + 3 * (size_t)(strip.columns >> (l - 1)) * (EXPMAP_BAND_ROWS >> (l - 1));
+
+	// The band's last row is at radius radius exp(-(rows - 1/2) step)
+	// pixels of the first frame, and its cells are step times that
+	const double rows = (double)(band.index + 1) * EXPMAP_BAND_ROWS - 0.5;
+	mpfr_set_d(globals.multiplier, -rows * strip.step, MPFR_RNDN);
+	mpfr_exp(globals.multiplier, globals.multiplier, MPFR_RNDN);
+	mpfr_mul(globals.multiplier, globals.multiplier, globals.start_multiplier, MPFR_RNDN);
+	mpfr_mul_d(globals.multiplier, globals.multiplier, strip.radius * strip.step, MPFR_RNDN);
+
+	// The strip's inner rows are deeper than the last frame, so they
+	// may need a reference orbit that the zoom itself did not
+	if (globals.orbit.segments == nullptr && mpfr_cmp_d(globals.multiplier, MANDELBROT_DIRECT_MULTIPLIER) < 0)
+		orbit_start(globals.orbit, globals.real, globals.imag, globals.precision, globals.iterations, globals.radius,
+			globals.options.orbit_storage, globals.options.orbit_cache);
+
+	globals.pixels = band.levels[0];
+	globals.width = strip.columns;
+	globals.height = EXPMAP_BAND_ROWS;
+	globals.column_positions = strip.angles.data();
+	globals.row_positions = strip.radii.data();
+	globals.polar = true;
+	const MandelbrotStats stats = mandelbrot(globals);
+
+	// Every cell averages the four cells it covers, as both sizes
+	// halve evenly
+	for (unsigned l = 1; l < strip.levels; ++l) {
+		const unsigned sw = strip.columns >> (l - 1), dw = strip.columns >> l, dh = EXPMAP_BAND_ROWS >> l;
+		const unsigned char* source = band.levels[l - 1];
+		unsigned char* destination = band.levels[l];
+
+		#pragma omp parallel for num_threads(globals.threads.load()) schedule(dynamic, FRAME_TILE_ROWS)
+		for (unsigned y = 0; y < dh; ++y) {
+			const unsigned char* row0 = source + 3 * (size_t)(2 * y) * sw;
+			const unsigned char* row1 = row0 + 3 * (size_t)sw;
+			unsigned char* out = destination + 3 * (size_t)y * dw;
+			for (unsigned x = 0; x < 3 * dw; x += 3)
+				for (unsigned c = 0; c < 3; ++c)
+					out[x + c] = (unsigned char)((row0[2 * x + c] + row0[2 * x + 3 + c] + row1[2 * x + c] + row1[2 * x + 3 + c] + 2) / 4);
+		}
+	}
+
+	strip.bands.push_back(band);
+	return stats;
+}
+
+bool expmap_ready(const ExpmapStrip& strip, double shift) {
+	return (double)strip.rendered * EXPMAP_BAND_ROWS >= shift + strip.far;
+}
+
+void expmap_release(ExpmapStrip& strip, double shift) {
+	while (!strip.bands.empty() && (double)(strip.bands.front().index + 1) * EXPMAP_BAND_ROWS <= shift + strip.near) {
+		delete[] strip.bands.front().levels[0];
+		strip.bands.pop_front();
+	}
+}
+
+void expmap_frame(const ExpmapStrip& strip, double shift, unsigned char* frame, unsigned threads) {
+	const unsigned width = strip.width, height = strip.height;
+
+	#pragma omp parallel for num_threads(threads) schedule(dynamic, FRAME_TILE_ROWS)
+	for (unsigned Y = 0; Y < height; ++Y) {
+		unsigned char* out = frame + 3 * (size_t)Y * width;
+		for (unsigned X = 0; X < width; ++X) {
+			const ExpmapSample& sample = strip.samples[(size_t)Y * width + X];
+			const unsigned columns = strip.columns >> sample.level;
+
+			// Rows move with the zoom, columns stay where they are
+			const double row = std::ldexp(shift, -(int)sample.level) + sample.row;
+			const double j = std::floor(row);
+			const float fy = (float)(row - j);
+			const float i = std::floor(sample.column);
+			const float fx = sample.column - i;
+			const unsigned i0 = ((long)i + columns) % columns, i1 = (i0 + 1) % columns;
+
+			const unsigned char* row0 = expmap_row(strip, sample.level, (long)j);
+			const unsigned char* row1 = expmap_row(strip, sample.level, (long)j + 1);
+			for (unsigned c = 0; c < 3; ++c) {
+				const float top = row0[3 * i0 + c] + fx * (row0[3 * i1 + c] - row0[3 * i0 + c]);
+				const float bottom = row1[3 * i0 + c] + fx * (row1[3 * i1 + c] - row1[3 * i0 + c]);
+				out[3 * X + c] = (unsigned char)std::min(top + fy * (bottom - top) + 0.5f, 255.0f);
+			}
+		}
+	}
+}
+
+void expmap_end(ExpmapStrip& strip) {
+	for (ExpmapBand& band : strip.bands)
+		delete[] band.levels[0];
+	strip.bands.clear();
+}
@@ -0,0 +1,110 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#pragma once
+#include "mandelbrot.hpp"
+#include <vector>
+#include <deque>
+
+/*
+	Number of rows of the strip rendered at once. Must be a multiple of
+	2^EXPMAP_LEVELS, so that every level of a band has whole rows.
+*/
+#define EXPMAP_BAND_ROWS 1024
+
+/*
+	Highest level of the strip's pyramid of downsampled copies. Pixels
+	near the center of a frame cover many strip cells, and read them
+	from a level where they cover one or two. The few pixels closer
+	than 2^-EXPMAP_LEVELS of the frame's radius cover more than that.
+*/
+#define EXPMAP_LEVELS 8
+
+/*
+	Where a frame pixel reads the strip: a level, and a cell of that
+	level, relative to the row the frame starts at.
+*/
+struct ExpmapSample {
+	double row;							/* row, relative to the frame's first row of the level */
+	float column;						/* column */
+	unsigned level;						/* level */
+};
+
+/*
+	A band of EXPMAP_BAND_ROWS rows of the strip, with a pyramid of
+	downsampled copies (mipmaps). Level l halves level l - 1 along both
+	axes.
+*/
+struct ExpmapBand {
+	unsigned index;						/* band number, from the outermost band */
+	std::vector<unsigned char*> levels;	/* pixels of every level, in one allocation */
+};
+
+/*
+	A zoom rendered in log-polar coordinates (an exponential map). Column
+	i is the angle (i + 1/2) step and row j the ring at radius
+	radius exp(-(j + 1/2) step), in pixels of the first frame, so cells
+	are square and each is rendered at the size frames show it at. A
+	frame zoomed in by exp(s step) is the strip from row s on, bent
+	back into a disk.
+
+	Only the bands the frames being synthesized read are kept: a frame
+	reads the rows [s + near, s + far).
+*/
+struct ExpmapStrip {
+	unsigned width, height;				/* frame resolution */
+	unsigned columns;					/* angles, a multiple of 2^(levels - 1) */
+	unsigned levels;					/* levels of every band */
+	double step;						/* angle between columns, and log of the ratio between rows */
+	double radius;						/* outer radius of row 0, in pixels of the first frame */
+	double near, far;					/* rows a frame reads, relative to its first row */
+	std::vector<double> angles;			/* (cos, sin) of every column's angle */
+	std::vector<double> radii;			/* radius of every row of a band, relative to the cells of its last row */
+	std::vector<ExpmapSample> samples;	/* where every frame pixel reads the strip */
+	std::deque<ExpmapBand> bands;		/* bands that are kept, from outer to inner */
+	unsigned rendered;					/* number of bands rendered */
+};
+
+/*
+	Lay out the strip for frames of the given resolution. The outer
+	ring of every frame is as dense as its pixels.
+*/
+void expmap_start(ExpmapStrip& strip, unsigned width, unsigned height);
+
+/*
+	Render the next band of the strip, with the polar grid of the band
+	given to the globals. Frames are zoomed in from the globals'
+	starting multiplier, as the pixel size of the first frame. The
+	multiplier is the size of the band's smallest cells, so the band is
+	only rendered with doubles when all of it is shallow enough. It is 
+	rendered and downsampled on the globals' threads.
+*/
+MandelbrotStats expmap_render(ExpmapStrip& strip, MandelbrotGlobals& globals);
+
+/*
+	Whether every band the frame starting at row `shift` reads has been
+	rendered.
+*/
+bool expmap_ready(const ExpmapStrip& strip, double shift);
+
+/*
+	Free the bands no frame from row `shift` on reads.
+*/
+void expmap_release(ExpmapStrip& strip, double shift);
+
+/*
+	Synthesize the frame starting at row `shift` of the strip. Every
+	pixel interpolates the four cells around it, in the level where it
+	covers one or two cells. Pixels read the same level in every frame,
+	so there is no popping between levels as the zoom goes on. Rows are 
+	synthesized on `threads` threads.
+*/
+void expmap_frame(const ExpmapStrip& strip, double shift, unsigned char* frame, unsigned threads);
+
+/*
+	Free every band of the strip.
+*/
+void expmap_end(ExpmapStrip& strip);
@@ -0,0 +1,535 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#include "./frame.hpp"
+#include "./mandelbrot.hpp"
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <omp.h>
+
+/*
+	Fraction of the footprint [a, a + length) that lies inside [0, size).
+*/
+MANDELBROT_INLINE static float frame_coverage(double a, double length, unsigned size) {
+	const double overlap = std::min(a + length, (double)size) - std::max(a, 0.0);
+	return overlap > 0.0 ? (float)(overlap / length) : 0.0f;
+}
+
+/*
+	Size of a keyframe level along an axis of `cells` level 0 cells.
+*/
+MANDELBROT_INLINE static unsigned frame_level_size(unsigned cells, unsigned level) {
+	return (cells + (1u << level) - 1) >> level;
+}
+
+/*
+	Finest level in which footprints of `length` level 0 cells are at 
+	most `limit` cells long.
+*/
+static unsigned frame_level(double length, double limit) {
+	return length > limit ? (unsigned)std::ceil(std::log2(length / limit)) : 0;
+}
+
+/*
+	Blend up to `taps` keyframe rows into one row of floats, for the
+	keyframe columns [lo, hi). Rows outside of the keyframe are skipped.
+*/
+template <int taps>
+MANDELBROT_INLINE static void frame_rows(
+	float* row,
+	const unsigned char* keyframe,
+	unsigned keyframe_width,
+	unsigned keyframe_height,
+	int first,
+	const float* weights,
+	unsigned lo,
+	unsigned hi 
+) {
+	for (unsigned i = 3 * lo; i < 3 * hi; ++i)
+		row[i] = 0.0f;
+	for (int j = 0; j < taps; ++j) {
+		const int y = first + j;
+		if (weights[j] == 0.0f || y < 0 || y >= (int)keyframe_height)
+			continue;
+		const unsigned char* source = keyframe + 3 * (size_t)y * keyframe_width;
+		const float w = weights[j];
+		#pragma GCC ivdep
+		for (unsigned i = 3 * lo; i < 3 * hi; ++i)
+			row[i] += w * source[i];
+	}
+}
+
+/*
+	Build the weights of `size` footprints in one keyframe level, where 
+	footprint i is [origin + length i, origin + length (i + 1)) in 
+	uniform cells, and level 0 samples have the given edges. Footprints 
+	are clipped to the keyframe, so cells outside of it count as black.
+*/
+template <int taps>
+static void frame_taps(FrameTaps& result, double origin, double length, unsigned size, const std::vector<double>& edges, unsigned level) {
+	const unsigned samples = edges.size() - 1;
+	const unsigned level_samples = frame_level_size(samples, level);
+	const double span = edges.back();
+	auto edge = [&](unsigned i) { return edges[std::min(i << level, samples)]; };
+
+	result.first.resize(size);
+	result.weights.resize(taps * size);
+	result.lo = level_samples;
+	result.hi = 0;
+	for (unsigned i = 0; i < size; ++i) {
+		const double a = origin + length * i;
+		const double lo = std::max(a, 0.0), hi = std::min(a + length, span);
+		float* weights = &result.weights[taps * i];
+		if (lo >= hi) {
+			result.first[i] = 0;
+			std::fill(weights, weights + taps, 0.0f);
+			continue;
+		}
+
+		// Find the cell holding the start of the footprint 
+		const unsigned sample = std::upper_bound(edges.begin(), edges.end(), lo) - edges.begin() - 1;
+		const unsigned first = std::min(sample, samples - 1) >> level;
+		for (int j = 0; j < taps; ++j) {
+			const double overlap = std::min(hi, edge(first + j + 1)) - std::max(lo, edge(first + j));
+			weights[j] = overlap > 0.0 ? (float)(overlap / length) : 0.0f;
+		}
+		result.first[i] = first;
+		result.lo = std::min(result.lo, first);
+		result.hi = std::max(result.hi, std::min(level_samples, first + taps));
+	}
+	result.lo = std::min(result.lo, result.hi);
+}
+
+/*
+	Build the weights of every footprint along an axis of `size` frame 
+	pixels, of a keyframe with `cells` uniform cells along it, whose 
+	samples are shifted by `offset`. Frame coordinate u is at keyframe0 
+	coordinate c + s Z0 (u - size / 2), where c = cells / 2 - offset and 
+	s = cells / size, and at keyframe1 coordinate 
+	c + s Z0 ratio (u - size / 2).
+*/
+static void frame_axis(FrameAxis& axis, const FrameFilter& filter, unsigned size, const std::vector<double>& edges, double offset) {
+	const unsigned cells = (unsigned)edges.back();
+	const double length0 = (double)cells / size * filter.Z0, length1 = length0 * filter.ratio;
+	const double center = cells / 2.0 - offset;
+	const double origin0 = center - length0 * (size / 2.0), origin1 = center - length1 * (size / 2.0);
+
+	frame_taps<FRAME_TAPS0>(axis.taps0, origin0, length0, size, edges, filter.level0);
+	frame_taps<FRAME_TAPS1>(axis.taps1, origin1, length1, size, edges, filter.level1);
+	axis.coverage.resize(size);
+	for (unsigned i = 0; i < size; ++i)
+		axis.coverage[i] = frame_coverage(origin1 + length1 * i, length1, cells);
+}
+
+/*
+	Place the samples along an axis of a keyframe that spans `cells` 
+	uniform cells. Foveated samples are 1 cell wide up to distance 
+	h / ratio from the center, where h = cells / 2, and ratio s / h 
+	cells wide at distance s beyond it. The number of samples from the 
+	center out to s is then
+	
+		S(s) = s								(s ≤ h / ratio)
+		S(s) = h / ratio (1 + ln(ratio s / h))	(s > h / ratio)
+	
+	which is rounded down to a whole number of samples, so that they 
+	get slightly wider instead of narrower than that.
+*/
+static void frame_edges(std::vector<double>& edges, unsigned cells, double ratio, bool foveated) {
+	const double h = cells / 2.0, core = h / ratio;
+	const unsigned half = (unsigned)(core * (1.0 + std::log(ratio)));
+	if (!foveated || half < 1 || 2 * half >= cells) {
+		edges.resize(cells + 1);
+		for (unsigned i = 0; i <= cells; ++i)
+			edges[i] = i;
+		return;
+	}
+
+	const double stretch = core * (1.0 + std::log(ratio)) / half;
+	edges.resize(2 * half + 1);
+	for (unsigned k = 0; k <= half; ++k) {
+		const double u = k * stretch;
+		const double s = u <= core ? u : core * std::exp(u / core - 1.0);
+		edges[half + k] = h + s;
+		edges[half - k] = h - s;
+	}
+	edges.front() = 0.0;
+	edges.back() = cells;
+}
+
+void frame_keyframe_start(FrameKeyframe& keyframe, unsigned width, unsigned height, double ratio, bool foveated) {
+	keyframe.span_width = frame_keyframe_size(width, ratio);
+	keyframe.span_height = frame_keyframe_size(height, ratio);
+	frame_edges(keyframe.columns, keyframe.span_width, ratio, foveated);
+	frame_edges(keyframe.rows, keyframe.span_height, ratio, foveated);
+	keyframe.width = keyframe.columns.size() - 1;
+	keyframe.height = keyframe.rows.size() - 1;
+	keyframe.aligned = keyframe.width == keyframe.span_width && keyframe.height == keyframe.span_height;
+	keyframe.foveated = foveated;
+	keyframe.ratio = ratio;
+	keyframe.offset_x = keyframe.aligned && keyframe.width % 2 == 0 ? -0.5 : 0.0;
+	keyframe.offset_y = keyframe.aligned && keyframe.height % 2 == 0 ? -0.5 : 0.0;
+	frame_keyframe_levels(keyframe, width, height, ratio);
+}
+
+void frame_keyframe_levels(FrameKeyframe& keyframe, unsigned width, unsigned height, double ratio) {
+	frame_keyframe_end(keyframe);
+
+	// Frames zoomed out the furthest are at Z0 = 1. Samples are at least 
+	// a cell wide, so footprints never cover more of them than of cells 
+	const double scale = std::max((double)keyframe.span_width / width, (double)keyframe.span_height / height);
+	const unsigned levels = 1 + std::max(frame_level(scale, FRAME_TAPS0 - 1), frame_level(scale * ratio, FRAME_TAPS1 - 1));
+
+	size_t bytes = 0;
+	for (unsigned l = 0; l < levels; ++l)
+		bytes += 3 * (size_t)frame_level_size(keyframe.width, l) * frame_level_size(keyframe.height, l);
+	keyframe.levels.resize(levels);
+	keyframe.levels[0] = new unsigned char[bytes];
+	for (unsigned l = 1; l < levels; ++l)
+		keyframe.levels[l] = keyframe.levels[l - 1] + 3 * (size_t)frame_level_size(keyframe.width, l - 1) * frame_level_size(keyframe.height, l - 1);
+}
+
+size_t frame_keyframe_bytes(const FrameKeyframe& keyframe) {
+	size_t bytes = 0;
+	for (unsigned l = 0; l < keyframe.levels.size(); ++l)
+		bytes += 3 * (size_t)frame_level_size(keyframe.width, l) * frame_level_size(keyframe.height, l);
+	return bytes;
+}
+
+void frame_keyframe_build(FrameKeyframe& keyframe, unsigned threads) {
+	for (unsigned l = 1; l < keyframe.levels.size(); ++l) {
+		const unsigned sw = frame_level_size(keyframe.width, l - 1), sh = frame_level_size(keyframe.height, l - 1);
+		const unsigned dw = frame_level_size(keyframe.width, l), dh = frame_level_size(keyframe.height, l);
+		const unsigned char* source = keyframe.levels[l - 1];
+		unsigned char* destination = keyframe.levels[l];
+
+		// Every cell averages the (up to) four cells it covers. Cells on 
+		// the last row or column of an odd size repeat the cells they have 
+		#pragma omp parallel for num_threads(threads) schedule(dynamic, FRAME_TILE_ROWS)
+		for (unsigned y = 0; y < dh; ++y) {
+			const unsigned char* row0 = source + 3 * (size_t)(2 * y) * sw;
+			const unsigned char* row1 = source + 3 * (size_t)std::min(2 * y + 1, sh - 1) * sw;
+			unsigned char* out = destination + 3 * (size_t)y * dw;
+			for (unsigned x = 0; x < dw; ++x) {
+				const unsigned x0 = 3 * (2 * x), x1 = 3 * std::min(2 * x + 1, sw - 1);
+				for (unsigned c = 0; c < 3; ++c)
+					out[3 * x + c] = (unsigned char)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+			}
+		}
+	}
+}
+
+/*
+	Layout of a keyframe file, which is followed by the edges of the 
+	columns and rows and the pixels of level 0. Uniform keyframes of 
+	version 2 and later are aligned, and version 3 records the keyframe 
+	ratio and foveation, which the edges alone do not tell apart.
+*/
+struct FrameKeyframeHeader {
+	char magic[4];						/* "MKF3" */
+	unsigned width, height;				/* samples of level 0 */
+	unsigned span_width, span_height;	/* uniform cells the keyframe spans */
+	unsigned foveated;					/* whether samples are foveated */
+	double ratio;						/* keyframe ratio */
+};
+
+bool frame_keyframe_save(const FrameKeyframe& keyframe, const char* path) {
+	const FrameKeyframeHeader header{{'M', 'K', 'F', '3'}, keyframe.width, keyframe.height, keyframe.span_width, keyframe.span_height, 
+		keyframe.foveated, keyframe.ratio};
+	FILE* file = fopen(path, "wb");
+	if (file == NULL)
+		return false;
+	const size_t bytes = 3 * (size_t)keyframe.width * keyframe.height;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(keyframe.columns.data(), sizeof(double), keyframe.columns.size(), file) == keyframe.columns.size() &&
+		fwrite(keyframe.rows.data(), sizeof(double), keyframe.rows.size(), file) == keyframe.rows.size() &&
+		fwrite(keyframe.levels[0], 1, bytes, file) == bytes;
+	return (fclose(file) == 0) && written;
+}
+
+bool frame_keyframe_load(FrameKeyframe& keyframe, const char* path, unsigned threads) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+
+	// The layout must match exactly, down to the keyframe ratio and the 
+	// edges of foveated samples 
+	FrameKeyframeHeader header;
+	std::vector<double> columns(keyframe.columns.size()), rows(keyframe.rows.size());
+	const size_t bytes = 3 * (size_t)keyframe.width * keyframe.height;
+	const bool read = fread(&header, sizeof(header), 1, file) == 1 &&
+		std::equal(header.magic, header.magic + 4, "MKF3") &&
+		header.width == keyframe.width && header.height == keyframe.height &&
+		header.span_width == keyframe.span_width && header.span_height == keyframe.span_height &&
+		header.foveated == keyframe.foveated && header.ratio == keyframe.ratio &&
+		fread(columns.data(), sizeof(double), columns.size(), file) == columns.size() && columns == keyframe.columns &&
+		fread(rows.data(), sizeof(double), rows.size(), file) == rows.size() && rows == keyframe.rows &&
+		fread(keyframe.levels[0], 1, bytes, file) == bytes;
+	fclose(file);
+	if (read)
+		frame_keyframe_build(keyframe, threads);
+	return read;
+}
+
+void frame_keyframe_end(FrameKeyframe& keyframe) {
+	if (!keyframe.levels.empty())
+		delete[] keyframe.levels[0];
+	keyframe.levels.clear();
+}
+
+const FrameFilter& frame_filter(
+	FrameFilterCache& cache,
+	double Z0,
+	double ratio,
+	unsigned width,
+	unsigned height,
+	const FrameKeyframe& keyframe 
+) {
+	// Zoom-in amounts that only differ by rounding share a filter 
+	const unsigned long long key = std::llround(std::ldexp(Z0, FRAME_FILTER_BITS));
+	auto found = cache.filters.find(key);
+	if (found != cache.filters.end() && found->second.ratio == ratio &&
+		found->second.width == width && found->second.height == height &&
+		found->second.keyframe_width == keyframe.width && found->second.keyframe_height == keyframe.height &&
+		found->second.span_width == keyframe.span_width && found->second.span_height == keyframe.span_height) {
+		++cache.hits;
+		return found->second;
+	}
+	++cache.misses;
+
+	// Make room for the new filter 
+	if (found == cache.filters.end()) {
+		if (cache.order.size() >= FRAME_FILTER_CACHE) {
+			cache.filters.erase(cache.order.front());
+			cache.order.pop_front();
+		}
+		cache.order.push_back(key);
+	}
+
+	FrameFilter& filter = cache.filters[key];
+	filter.Z0 = Z0;
+	filter.ratio = ratio;
+	filter.width = width;
+	filter.height = height;
+	filter.keyframe_width = keyframe.width;
+	filter.keyframe_height = keyframe.height;
+	filter.span_width = keyframe.span_width;
+	filter.span_height = keyframe.span_height;
+
+	// Read every keyframe from the finest level where footprints still 
+	// fit in the taps 
+	const unsigned last = keyframe.levels.size() - 1;
+	const double scale = std::max((double)keyframe.span_width / width, (double)keyframe.span_height / height);
+	filter.level0 = std::min(last, frame_level(scale * Z0, FRAME_TAPS0 - 1));
+	filter.level1 = std::min(last, frame_level(scale * Z0 * ratio, FRAME_TAPS1 - 1));
+
+	// Keyframe1 fades in as Z0 goes from 1 to 1 / ratio 
+	filter.t = (float)((1.0 - Z0) * ratio / (ratio - 1.0));
+	frame_axis(filter.x, filter, width, keyframe.columns, keyframe.offset_x);
+	frame_axis(filter.y, filter, height, keyframe.rows, keyframe.offset_y);
+	return filter;
+}
+
+size_t frame_bytes(unsigned width, unsigned height, FrameFormat format) {
+	const size_t chroma = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+	switch (format) {
+		case FrameFormat::Yuv420: return (size_t)width * height + 2 * chroma;
+		case FrameFormat::Yuv420p10: return 2 * ((size_t)width * height + 2 * chroma);
+		default: return (size_t)width * height * 3;
+	}
+}
+
+/*
+	Keyframe levels a frame is synthesized from, and the scratch rows 
+	of the thread synthesizing it.
+*/
+struct FrameSource {
+	const unsigned char* level0;		/* level read from keyframe0 */
+	const unsigned char* level1;		/* level read from keyframe1 */
+	unsigned w0, h0, w1, h1;			/* sizes of those levels */
+	std::vector<float> row0, row1;		/* blended keyframe rows */
+};
+
+/*
+	Synthesize row Y of a frame into separate red, green and blue rows, 
+	before quantization.
+*/
+MANDELBROT_INLINE static void frame_row(const FrameFilter& filter, FrameSource& source, unsigned Y, float* red, float* green, float* blue) {
+	const FrameAxis& x = filter.x;
+	const FrameAxis& y = filter.y;
+	const float t = filter.t;
+	const float cy = t * y.coverage[Y];
+	frame_rows<FRAME_TAPS0>(source.row0.data(), source.level0, source.w0, source.h0, y.taps0.first[Y], &y.taps0.weights[FRAME_TAPS0 * Y], x.taps0.lo, x.taps0.hi);
+	if (cy > 0.0f)
+		frame_rows<FRAME_TAPS1>(source.row1.data(), source.level1, source.w1, source.h1, y.taps1.first[Y], &y.taps1.weights[FRAME_TAPS1 * Y], x.taps1.lo, x.taps1.hi);
+
+	for (unsigned X = 0; X < filter.width; ++X) {
+		// Gather the zoomed-in keyframe0
+		const float* wx0 = &x.taps0.weights[FRAME_TAPS0 * X];
+		const float* source0 = source.row0.data() + 3 * x.taps0.first[X];
+		float r = 0.0f, g = 0.0f, b = 0.0f;
+		for (int i = 0; i < FRAME_TAPS0; ++i) {
+			r += wx0[i] * source0[3 * i + 0];
+			g += wx0[i] * source0[3 * i + 1];
+			b += wx0[i] * source0[3 * i + 2];
+		}
+
+		// Blend in the part of keyframe1 that covers the pixel
+		const float c = cy * x.coverage[X];
+		if (c > 0.0f) {
+			const float* wx1 = &x.taps1.weights[FRAME_TAPS1 * X];
+			const float* source1 = source.row1.data() + 3 * x.taps1.first[X];
+			float r1 = 0.0f, g1 = 0.0f, b1 = 0.0f;
+			for (int i = 0; i < FRAME_TAPS1; ++i) {
+				r1 += wx1[i] * source1[3 * i + 0];
+				g1 += wx1[i] * source1[3 * i + 1];
+				b1 += wx1[i] * source1[3 * i + 2];
+			}
+			r = r * (1.0f - c) + t * r1;
+			g = g * (1.0f - c) + t * g1;
+			b = b * (1.0f - c) + t * b1;
+		}
+		red[X] = r;
+		green[X] = g;
+		blue[X] = b;
+	}
+}
+
+/*
+	BT.709 luma and chroma of a color, in limited range: luma from 16 to 
+	235 and chroma from 16 to 240 (times 4 for 10 bits), rounded.
+*/
+MANDELBROT_INLINE static float frame_luma(float r, float g, float b, float scale) {
+	return std::clamp((16.0f + (0.2126f * r + 0.7152f * g + 0.0722f * b) * (219.0f / 255.0f)) * scale + 0.5f, 0.0f, 255.0f * scale);
+}
+MANDELBROT_INLINE static float frame_cb(float r, float g, float b, float scale) {
+	return std::clamp((128.0f + (-0.1146f * r - 0.3854f * g + 0.5f * b) * (224.0f / 255.0f)) * scale + 0.5f, 0.0f, 255.0f * scale);
+}
+MANDELBROT_INLINE static float frame_cr(float r, float g, float b, float scale) {
+	return std::clamp((128.0f + (0.5f * r - 0.4542f * g - 0.0458f * b) * (224.0f / 255.0f)) * scale + 0.5f, 0.0f, 255.0f * scale);
+}
+
+/*
+	Convert a pair of synthesized rows (the same row twice at the 
+	bottom of an odd frame) to the luma of both and the chroma of the 
+	pair, which averages the 2x2 pixels it covers. Samples are bytes, 
+	or 16-bit little-endian words for 10 bits.
+*/
+template <typename Sample>
+MANDELBROT_INLINE static void frame_yuv_rows(
+	const float* top,
+	const float* bottom,
+	unsigned width,
+	Sample* luma0,
+	Sample* luma1,
+	Sample* cb,
+	Sample* cr,
+	float scale 
+) {
+	const float* r0 = top; const float* g0 = top + width; const float* b0 = top + 2 * width;
+	const float* r1 = bottom; const float* g1 = bottom + width; const float* b1 = bottom + 2 * width;
+
+	#pragma GCC ivdep
+	for (unsigned X = 0; X < width; ++X) {
+		luma0[X] = (Sample)frame_luma(r0[X], g0[X], b0[X], scale);
+		luma1[X] = (Sample)frame_luma(r1[X], g1[X], b1[X], scale);
+	}
+
+	// The last chroma sample of an odd row only covers one column 
+	const unsigned pairs = width / 2;
+	#pragma GCC ivdep
+	for (unsigned X = 0; X < pairs; ++X) {
+		const float r = 0.25f * (r0[2 * X] + r0[2 * X + 1] + r1[2 * X] + r1[2 * X + 1]);
+		const float g = 0.25f * (g0[2 * X] + g0[2 * X + 1] + g1[2 * X] + g1[2 * X + 1]);
+		const float b = 0.25f * (b0[2 * X] + b0[2 * X + 1] + b1[2 * X] + b1[2 * X + 1]);
+		cb[X] = (Sample)frame_cb(r, g, b, scale);
+		cr[X] = (Sample)frame_cr(r, g, b, scale);
+	}
+	if (width % 2 != 0) {
+		const unsigned X = width - 1;
+		const float r = 0.5f * (r0[X] + r1[X]), g = 0.5f * (g0[X] + g1[X]), b = 0.5f * (b0[X] + b1[X]);
+		cb[pairs] = (Sample)frame_cb(r, g, b, scale);
+		cr[pairs] = (Sample)frame_cr(r, g, b, scale);
+	}
+}
+
+/*
+	Synthesize the frame in planar YUV 4:2:0, a pair of rows at a time, 
+	so that RGB rows never leave the thread's scratch.
+*/
+template <typename Sample>
+static void frame_synthesize_yuv(const FrameFilter& filter, Sample* frame, FrameSource& source, float scale) {
+	const unsigned width = filter.width, height = filter.height;
+	const unsigned chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+	Sample* cb_plane = frame + (size_t)width * height;
+	Sample* cr_plane = cb_plane + (size_t)chroma_width * chroma_height;
+
+	std::vector<float> rows(6 * width);
+	#pragma omp for schedule(dynamic, FRAME_TILE_ROWS / 2)
+	for (unsigned pair = 0; pair < chroma_height; ++pair) {
+		const unsigned Y = 2 * pair;
+		float* top = rows.data();
+		float* bottom = Y + 1 < height ? rows.data() + 3 * width : top;
+		frame_row(filter, source, Y, top, top + width, top + 2 * width);
+		if (bottom != top)
+			frame_row(filter, source, Y + 1, bottom, bottom + width, bottom + 2 * width);
+
+		Sample* luma0 = frame + (size_t)Y * width;
+		Sample* luma1 = bottom != top ? luma0 + width : luma0;
+		frame_yuv_rows(top, bottom, width, luma0, luma1, cb_plane + (size_t)pair * chroma_width, cr_plane + (size_t)pair * chroma_width, scale);
+	}
+}
+
+void frame_synthesize(
+	const FrameFilter& filter,
+	unsigned char* frame,
+	const FrameKeyframe& keyframe0,
+	const FrameKeyframe& keyframe1,
+	FrameFormat format,
+	unsigned threads 
+) {
+	const unsigned width = filter.width, height = filter.height;
+
+	// Sizes of the keyframe levels that are read 
+	FrameSource shared;
+	shared.w0 = frame_level_size(keyframe0.width, filter.level0);
+	shared.h0 = frame_level_size(keyframe0.height, filter.level0);
+	shared.w1 = frame_level_size(keyframe1.width, filter.level1);
+	shared.h1 = frame_level_size(keyframe1.height, filter.level1);
+	shared.level0 = keyframe0.levels[filter.level0];
+	shared.level1 = keyframe1.levels[filter.level1];
+
+	// Frames synthesized concurrently each run on a single thread 
+	#pragma omp parallel num_threads(threads) if(!omp_in_parallel())
+	{
+		// Blended keyframe rows, padded with zeros so that the taps of
+		// pixels at the edges never read outside of them
+		FrameSource source = shared;
+		source.row0.assign(3 * (source.w0 + FRAME_TAPS0), 0.0f);
+		source.row1.assign(3 * (source.w1 + FRAME_TAPS1), 0.0f);
+
+		if (format == FrameFormat::Yuv420)
+			frame_synthesize_yuv<unsigned char>(filter, frame, source, 1.0f);
+		else if (format == FrameFormat::Yuv420p10)
+			frame_synthesize_yuv<unsigned short>(filter, (unsigned short*)frame, source, 4.0f);
+		else {
+			std::vector<float> rgb(3 * width);
+			#pragma omp for schedule(dynamic, FRAME_TILE_ROWS)
+			for (unsigned Y = 0; Y < height; ++Y) {
+				frame_row(filter, source, Y, rgb.data(), rgb.data() + width, rgb.data() + 2 * width);
+
+				// Quantize to 8 bits
+				unsigned char* out = frame + 3 * (size_t)Y * width;
+				for (unsigned X = 0; X < width; ++X) {
+					out[3 * X + 0] = (unsigned char)std::min(rgb[X] + 0.5f, 255.0f);
+					out[3 * X + 1] = (unsigned char)std::min(rgb[width + X] + 0.5f, 255.0f);
+					out[3 * X + 2] = (unsigned char)std::min(rgb[2 * width + X] + 0.5f, 255.0f);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,240 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#pragma once
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+
+/*
+	Number of rows every thread synthesizes at once. Rows are
+	independent, so this only trades scheduling overhead against
+	load balance.
+*/
+#define FRAME_TILE_ROWS 8
+
+/*
+	Maximum number of frames a video synthesizes at once by default, 
+	each into its own frame buffer.
+*/
+#define FRAME_BUFFERS 16
+
+/*
+	Filters are looked up by Z0 rounded to this many fractional bits. 
+	Frames whose Z0 only differs by less than that are off by less than 
+	a millionth of a pixel, but the same zoom-in amount computed in two 
+	keyframe intervals rarely rounds to the same double.
+*/
+#define FRAME_FILTER_BITS 32
+
+/*
+	Maximum number of filters a FrameFilterCache keeps. When it is 
+	full, the oldest filter is dropped.
+*/
+#define FRAME_FILTER_CACHE 256
+
+/*
+	Keyframe cells a frame pixel's footprint may cover along one axis,
+	in keyframe0 and in keyframe1. Footprints are read from the finest
+	keyframe level where they are at most 2 and 4 cells long, which
+	covers parts of at most 3 and 5 cells.
+*/
+#define FRAME_TAPS0 3
+#define FRAME_TAPS1 5
+
+/*
+	A keyframe with a pyramid of downsampled copies (mipmaps). Level l
+	is level 0 downsampled by 2^l, rounding sizes up, so that frames
+	zoomed far out of a large keyframe read it from a level where a
+	frame pixel only covers a few cells, instead of aliasing.
+
+	The keyframe spans a grid of span_width by span_height uniform 
+	cells, ratio times the frame's resolution. Its pixels (samples) 
+	may be sparser than that: sample i covers the cells between edges 
+	columns[i] and columns[i + 1] (which may be fractional), and is 
+	rendered at their middle. A cell of level l covers samples 
+	[2^l i, 2^l (i + 1)) of level 0.
+
+	Uniform keyframes are aligned: the view's center is on a sample 
+	rather than between the middle two, and every sample is shifted by 
+	the offset. For an integer ratio, every ratio-th sample of the next 
+	keyframe from the center is then a sample of this one.
+*/
+struct FrameKeyframe {
+	unsigned width, height;					/* samples of level 0 */
+	unsigned span_width, span_height;		/* uniform cells the keyframe spans */
+	std::vector<double> columns;			/* edges of the columns of level 0, in uniform cells */
+	std::vector<double> rows;				/* edges of the rows of level 0, in uniform cells */
+	std::vector<unsigned char*> levels;		/* pixels of every level, in one allocation */
+	bool aligned;							/* whether samples are uniform and centered on sample (width / 2, height / 2) */
+	bool foveated;							/* whether samples were laid out foveated */
+	double ratio;							/* keyframe ratio the samples were laid out for */
+	double offset_x, offset_y;				/* offset of the samples' centers from the middle of their edges */
+};
+
+/*
+	Separable weights of a frame's footprints in one keyframe along one
+	axis. Frame pixel i covers the cells [first[i], first[i] + taps) of
+	the keyframe level with weights[taps i ...].
+*/
+struct FrameTaps {
+	std::vector<int> first;				/* first cell of every footprint */
+	std::vector<float> weights;			/* cell weights */
+	unsigned lo, hi;					/* cells any footprint covers */
+};
+
+/*
+	Separable weights of a frame's footprints along one axis.
+	coverage[i] is the fraction of the footprint of frame pixel i
+	that keyframe1 covers.
+*/
+struct FrameAxis {
+	FrameTaps taps0;					/* keyframe0 weights */
+	FrameTaps taps1;					/* keyframe1 weights */
+	std::vector<float> coverage;		/* fraction of the footprint keyframe1 covers */
+};
+
+/*
+	Everything frame synthesis needs to know about a zoom-in amount Z0, 
+	which is the same for every frame with that Z0.
+*/
+struct FrameFilter {
+	double Z0;							/* zoom-in amount with respect to keyframe0 */
+	double ratio;						/* zoom from one keyframe to the next */
+	unsigned width, height;				/* frame resolution */
+	unsigned keyframe_width;			/* keyframe samples */
+	unsigned keyframe_height;
+	unsigned span_width, span_height;	/* uniform cells keyframes span */
+	unsigned level0, level1;			/* keyframe levels read from keyframe0 and keyframe1 */
+	float t;							/* how far keyframe1 is faded in */
+	FrameAxis x, y;						/* horizontal and vertical weights */
+};
+
+/*
+	Filters of recently synthesized frames. Whenever a zoom runs through 
+	the same zoom-in amounts in every keyframe interval, their filters 
+	are only built once. That is only the case when an interval spans a 
+	whole number of frames, i.e. when (frames - 1) * log(ratio) divided 
+	by log(ezoom / zoom) is an integer. Otherwise Z0 does not repeat and 
+	nearly every lookup misses. Keys are not coarser than that, since 
+	frames synthesized at a rounded Z0 would visibly jitter.
+*/
+struct FrameFilterCache {
+	std::unordered_map<unsigned long long, FrameFilter> filters;	/* filters by rounded Z0 */
+	std::deque<unsigned long long> order;						/* keys from oldest to newest */
+	unsigned long long hits = 0, misses = 0;					/* lookup statistics */
+};
+
+/*
+	Size of a keyframe along an axis of `size` frame pixels, when 
+	keyframes are `ratio` times the frame's resolution.
+*/
+inline unsigned frame_keyframe_size(unsigned size, double ratio) {
+	return (unsigned)std::max(1l, std::lround(ratio * size));
+}
+
+/*
+	Allocate a keyframe for frames of the given resolution, zooming by
+	`ratio` from one keyframe to the next. The keyframe spans `ratio` 
+	times the frame's resolution, and has as many levels as its frames 
+	read.
+
+	A foveated keyframe only has full density in its center. Frames 
+	only show a cell at distance d from the center (relative to the 
+	keyframe's half size) while Z0 ≥ d, when a frame pixel covers 
+	ratio d cells, so samples there are ratio d cells wide. Along each 
+	axis, that takes (1 + ln ratio) / ratio of the samples.
+*/
+void frame_keyframe_start(FrameKeyframe& keyframe, unsigned width, unsigned height, double ratio, bool foveated);
+
+/*
+	Allocate the levels of a keyframe for frames of the given resolution, 
+	which may be another one than the keyframe was laid out for. Its 
+	pixels are lost.
+*/
+void frame_keyframe_levels(FrameKeyframe& keyframe, unsigned width, unsigned height, double ratio);
+
+/*
+	Bytes of the pixels of every level of a keyframe.
+*/
+size_t frame_keyframe_bytes(const FrameKeyframe& keyframe);
+
+/*
+	Downsample level 0 of a keyframe, once it is rendered, into its
+	other levels, with `threads` threads.
+*/
+void frame_keyframe_build(FrameKeyframe& keyframe, unsigned threads);
+
+/*
+	Write level 0 of a keyframe, with its layout, to a file. Returns 
+	whether that succeeded.
+*/
+bool frame_keyframe_save(const FrameKeyframe& keyframe, const char* path);
+
+/*
+	Read level 0 of a keyframe from a file written by 
+	frame_keyframe_save, and build its other levels with `threads` 
+	threads. Returns false if the file cannot be read or holds a 
+	keyframe with another layout, in which case the keyframe's pixels 
+	are undefined.
+*/
+bool frame_keyframe_load(FrameKeyframe& keyframe, const char* path, unsigned threads);
+
+/*
+	Free a keyframe.
+*/
+void frame_keyframe_end(FrameKeyframe& keyframe);
+
+/*
+	Find the filter for Z0, building it if it is not in the cache.
+*/
+const FrameFilter& frame_filter(
+	FrameFilterCache& cache,
+	double Z0,
+	double ratio,
+	unsigned width,
+	unsigned height,
+	const FrameKeyframe& keyframe 
+);
+
+/*
+	Pixel format of synthesized frames.
+*/
+enum class FrameFormat {
+	Rgb,						/* 8-bit RGB, interleaved */
+	Yuv420,						/* 8-bit BT.709 limited-range YUV 4:2:0, planar */
+	Yuv420p10					/* 10-bit BT.709 limited-range YUV 4:2:0, planar, in 16-bit little-endian words */
+};
+
+/*
+	Bytes of a frame of the given resolution and format. Chroma planes 
+	of YUV 4:2:0 are half the resolution, rounded up.
+*/
+size_t frame_bytes(unsigned width, unsigned height, FrameFormat format);
+
+/*
+	Synthesize a video frame from two keyframes. The frame shows
+	keyframe0 zoomed in by 1 / Z0 (1 / ratio < Z0 ≤ 1), with the centre
+	of keyframe1 blended in as it becomes sharper than the zoomed-in
+	keyframe0.
+
+	Every frame pixel gathers the keyframe pixels its footprint covers,
+	weighted by the area they cover, so rows are synthesized in
+	parallel without synchronization, with `threads` threads. Called 
+	from within a parallel region, the frame is synthesized by the 
+	calling thread alone. YUV frames are converted a pair of rows at 
+	a time, as they are synthesized.
+*/
+void frame_synthesize(
+	const FrameFilter& filter,
+	unsigned char* frame,
+	const FrameKeyframe& keyframe0,
+	const FrameKeyframe& keyframe1,
+	FrameFormat format,
+	unsigned threads 
+);
@@ -0,0 +1,309 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#include "./image.hpp"
+#include "./base.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <zlib.h>
+#include <omp.h>
+
+/*
+	Bytes of the window of a deflate stream, which blocks are primed
+	with.
+*/
+#define IMAGE_PNG_WINDOW 32768
+
+ImageFormat image_format(const std::string& path) {
+	const size_t dot = path.find_last_of("./\\");
+	if (dot == std::string::npos || path[dot] != '.')
+		return ImageFormat::Ffmpeg;
+	std::string extension = path.substr(dot + 1);
+	for (char& c : extension)
+		c = (char)tolower((unsigned char)c);
+	if (extension == "ppm")
+		return ImageFormat::Ppm;
+	if (extension == "qoi")
+		return ImageFormat::Qoi;
+	if (extension == "png")
+		return ImageFormat::Png;
+	return ImageFormat::Ffmpeg;
+}
+
+/*
+	Write a big-endian 32-bit number.
+*/
+static void image_u32(unsigned char* out, unsigned long value) {
+	out[0] = (unsigned char)(value >> 24);
+	out[1] = (unsigned char)(value >> 16);
+	out[2] = (unsigned char)(value >> 8);
+	out[3] = (unsigned char)value;
+}
+
+/*
+	Write a PNG chunk.
+*/
+static void image_chunk(FILE* file, const char* type, const unsigned char* data, size_t bytes) {
+	unsigned char length[4], crc[4];
+	image_u32(length, bytes);
+	uLong sum = crc32(0, (const Bytef*)type, 4);
+	if (bytes != 0)
+		sum = crc32_z(sum, data, bytes);
+	image_u32(crc, sum);
+	fwrite(length, 1, 4, file);
+	fwrite(type, 1, 4, file);
+	fwrite(data, 1, bytes, file);
+	fwrite(crc, 1, 4, file);
+}
+
+void image_start(ImageWriter& writer, const std::string& path, unsigned width, unsigned height, unsigned threads) {
+	writer.format = image_format(path);
+	writer.threads = threads;
+	writer.width = width;
+	writer.height = height;
+	writer.rows = 0;
+	if (writer.format == ImageFormat::Ffmpeg) {
+		// We make a pipe to use with the ffmpeg command-line utility, 
+		// and we pipe to it in binary mode.
+		const std::string size = std::to_string(width) + "x" + std::to_string(height);
+		writer.pipe = encoder_pipe_open({"ffmpeg", "-f", "rawvideo", "-pix_fmt", "argb", "-s", size, "-c:v", "ppm", "-i", "-",
+			path, "-s", size, "-update", "true", "-y"});
+		char header[64];
+		encoder_pipe_write(writer.pipe, header, snprintf(header, sizeof(header), "P6 %d %d 255 ", width, height));
+		return;
+	}
+
+	writer.file = fopen(path.c_str(), "wb");
+	if (writer.file == NULL)
+		fatal_error("Failed opening '%s' for writing", path.c_str());
+	if (writer.format == ImageFormat::Ppm)
+		fprintf(writer.file, "P6\n%u %u\n255\n", width, height);
+	else if (writer.format == ImageFormat::Qoi) {
+		// Pixels start out as opaque black, and the index as zeros
+		unsigned char header[14] = {'q', 'o', 'i', 'f'};
+		image_u32(header + 4, width);
+		image_u32(header + 8, height);
+		header[12] = 3;
+		header[13] = 0;
+		fwrite(header, 1, sizeof(header), writer.file);
+		memset(writer.qoi_index, 0, sizeof(writer.qoi_index));
+		memset(writer.qoi_previous, 0, sizeof(writer.qoi_previous));
+		writer.qoi_run = 0;
+	}
+	else {
+		static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+		unsigned char header[13];
+		image_u32(header + 0, width);
+		image_u32(header + 4, height);
+		header[8] = 8;
+		header[9] = 2;
+		header[10] = header[11] = header[12] = 0;
+		fwrite(signature, 1, sizeof(signature), writer.file);
+		image_chunk(writer.file, "IHDR", header, sizeof(header));
+		writer.above.assign((size_t)width * 3, 0);
+		writer.window.clear();
+		writer.adler = adler32(0, Z_NULL, 0);
+	}
+}
+
+/*
+	Emit the run of pixels repeating the previous one.
+*/
+static void image_qoi_run(ImageWriter& writer) {
+	if (writer.qoi_run > 0)
+		fputc(0xC0 | (writer.qoi_run - 1), writer.file);
+	writer.qoi_run = 0;
+}
+
+/*
+	Encode rows as QOI, which is sequential: every pixel is coded
+	relative to the one before it.
+*/
+static void image_qoi_rows(ImageWriter& writer, const unsigned char* pixels, size_t count) {
+	unsigned char* index = writer.qoi_index;
+	unsigned char* previous = writer.qoi_previous;
+	for (size_t i = 0; i < count; ++i) {
+		const unsigned char* pixel = pixels + 3 * i;
+		if (memcmp(pixel, previous, 3) == 0) {
+			if (++writer.qoi_run == 62)
+				image_qoi_run(writer);
+			continue;
+		}
+		image_qoi_run(writer);
+
+		// Every pixel is opaque, unlike the zeros the index starts out as 
+		const unsigned hash = (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + 255 * 11) % 64;
+		if (index[4 * hash + 3] == 255 && memcmp(index + 4 * hash, pixel, 3) == 0)
+			fputc(hash, writer.file);
+		else {
+			memcpy(index + 4 * hash, pixel, 3);
+			index[4 * hash + 3] = 255;
+			const int dr = (signed char)(pixel[0] - previous[0]);
+			const int dg = (signed char)(pixel[1] - previous[1]);
+			const int db = (signed char)(pixel[2] - previous[2]);
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+				fputc(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2), writer.file);
+			else if (dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 && db - dg >= -8 && db - dg <= 7) {
+				fputc(0x80 | (dg + 32), writer.file);
+				fputc((dr - dg + 8) << 4 | (db - dg + 8), writer.file);
+			}
+			else {
+				const unsigned char rgb[4] = {0xFE, pixel[0], pixel[1], pixel[2]};
+				fwrite(rgb, 1, sizeof(rgb), writer.file);
+			}
+		}
+		memcpy(previous, pixel, 3);
+	}
+}
+
+/*
+	PNG's Paeth predictor.
+*/
+static inline int image_paeth(int a, int b, int c) {
+	const int p = a + b - c;
+	const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/*
+	Filter a row of `bytes` bytes against the row above it, with the
+	filter whose output has the smallest sum of absolute values (as
+	signed bytes), which usually compresses best. The filter type is
+	written first. Filters are tried in `candidate`, of `bytes` bytes.
+*/
+static void image_png_filter(const unsigned char* row, const unsigned char* above, size_t bytes, unsigned char* out, unsigned char* candidate) {
+	unsigned long best = ~0ul;
+	for (unsigned char type = 0; type < 5; ++type) {
+		unsigned long sum = 0;
+		for (size_t i = 0; i < bytes; ++i) {
+			const int left = i >= 3 ? row[i - 3] : 0, up = above[i], corner = i >= 3 ? above[i - 3] : 0;
+			int prediction = 0;
+			switch (type) {
+				case 1: prediction = left; break;
+				case 2: prediction = up; break;
+				case 3: prediction = (left + up) / 2; break;
+				case 4: prediction = image_paeth(left, up, corner); break;
+			}
+			candidate[i] = (unsigned char)(row[i] - prediction);
+			sum += abs((signed char)candidate[i]);
+		}
+		if (sum < best) {
+			best = sum;
+			out[0] = type;
+			memcpy(out + 1, candidate, bytes);
+		}
+	}
+}
+
+/*
+	Filter and compress rows as PNG. Rows are filtered in parallel,
+	then compressed in blocks of IMAGE_PNG_BLOCK bytes in parallel.
+	Every block but the last of the image ends with a sync flush, so
+	that it ends on a byte, and blocks are written as consecutive IDAT
+	chunks of a single zlib stream, whose checksum is combined from
+	theirs.
+*/
+static void image_png_rows(ImageWriter& writer, const unsigned char* pixels, unsigned count) {
+	const size_t row_bytes = (size_t)writer.width * 3, line = row_bytes + 1;
+	std::vector<unsigned char> filtered(count * line);
+	#pragma omp parallel num_threads(writer.threads)
+	{
+		std::vector<unsigned char> candidate(row_bytes);
+		#pragma omp for schedule(dynamic, 16)
+		for (unsigned y = 0; y < count; ++y)
+			image_png_filter(pixels + y * row_bytes, y > 0 ? pixels + (y - 1) * row_bytes : writer.above.data(), row_bytes, &filtered[y * line], candidate.data());
+	}
+	memcpy(writer.above.data(), pixels + (count - 1) * row_bytes, row_bytes);
+
+	// Blocks are whole rows
+	const bool first = writer.rows == 0, last = writer.rows + count == writer.height;
+	const unsigned block_rows = (unsigned)std::max<size_t>(IMAGE_PNG_BLOCK / line, 1);
+	const unsigned blocks = (count + block_rows - 1) / block_rows;
+	std::vector<std::vector<unsigned char>> streams(blocks);
+	std::vector<uLong> sums(blocks);
+	#pragma omp parallel for num_threads(writer.threads) schedule(dynamic, 1)
+	for (unsigned b = 0; b < blocks; ++b) {
+		const size_t begin = b * block_rows * line, end = std::min(count, (b + 1) * block_rows) * line;
+		z_stream stream{};
+		deflateInit2(&stream, IMAGE_PNG_LEVEL, Z_DEFLATED, -15, 8, Z_FILTERED);
+
+		// Prime the block with the data a single stream would have in 
+		// its window, which may be from the previous band
+		if (begin >= IMAGE_PNG_WINDOW)
+			deflateSetDictionary(&stream, &filtered[begin - IMAGE_PNG_WINDOW], IMAGE_PNG_WINDOW);
+		else {
+			std::vector<unsigned char> window(writer.window.end() - std::min(writer.window.size(), IMAGE_PNG_WINDOW - begin), writer.window.end());
+			window.insert(window.end(), filtered.begin(), filtered.begin() + begin);
+			if (!window.empty())
+				deflateSetDictionary(&stream, window.data(), window.size());
+		}
+
+		// Header and trailer of the zlib stream go around the first and 
+		// last blocks
+		std::vector<unsigned char>& out = streams[b];
+		const size_t header = first && b == 0 ? 2 : 0;
+		out.resize(header + deflateBound(&stream, end - begin) + 16);
+		if (header != 0) {
+			out[0] = 0x78;
+			out[1] = 0x9C;
+		}
+		stream.next_in = &filtered[begin];
+		stream.avail_in = (uInt)(end - begin);
+		stream.next_out = out.data() + header;
+		stream.avail_out = (uInt)(out.size() - header);
+		deflate(&stream, last && b == blocks - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+		out.resize(out.size() - stream.avail_out);
+		deflateEnd(&stream);
+		sums[b] = adler32_z(adler32(0, Z_NULL, 0), &filtered[begin], end - begin);
+	}
+
+	for (unsigned b = 0; b < blocks; ++b) {
+		const size_t bytes = (std::min(count, (b + 1) * block_rows) - b * block_rows) * line;
+		writer.adler = adler32_combine(writer.adler, sums[b], bytes);
+		if (last && b == blocks - 1) {
+			streams[b].resize(streams[b].size() + 4);
+			image_u32(&streams[b][streams[b].size() - 4], writer.adler);
+		}
+		image_chunk(writer.file, "IDAT", streams[b].data(), streams[b].size());
+	}
+
+	// Keep the tail of the rows for the next band's first block
+	writer.window.insert(writer.window.end(), filtered.end() - std::min(filtered.size(), (size_t)IMAGE_PNG_WINDOW), filtered.end());
+	if (writer.window.size() > IMAGE_PNG_WINDOW)
+		writer.window.erase(writer.window.begin(), writer.window.end() - IMAGE_PNG_WINDOW);
+}
+
+void image_write(ImageWriter& writer, const unsigned char* pixels, unsigned count) {
+	const size_t bytes = (size_t)count * writer.width * 3;
+	if (writer.format == ImageFormat::Ffmpeg)
+		encoder_pipe_write(writer.pipe, pixels, bytes);
+	else if (writer.format == ImageFormat::Ppm)
+		fwrite(pixels, 1, bytes, writer.file);
+	else if (writer.format == ImageFormat::Qoi)
+		image_qoi_rows(writer, pixels, (size_t)count * writer.width);
+	else
+		image_png_rows(writer, pixels, count);
+	writer.rows += count;
+}
+
+void image_end(ImageWriter& writer) {
+	if (writer.format == ImageFormat::Ffmpeg) {
+		if (!encoder_pipe_close(writer.pipe))
+			fatal_error("ffmpeg failed writing the image");
+		return;
+	}
+	if (writer.format == ImageFormat::Qoi) {
+		static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+		image_qoi_run(writer);
+		fwrite(end, 1, sizeof(end), writer.file);
+	}
+	else if (writer.format == ImageFormat::Png)
+		image_chunk(writer.file, "IEND", nullptr, 0);
+	if (fclose(writer.file) != 0)
+		fatal_error("Failed writing the image");
+}
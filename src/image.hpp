@@ -0,0 +1,75 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#pragma once
+#include "encoder.hpp"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/*
+	Bytes of filtered rows every thread compresses at once when writing
+	a PNG. Blocks are compressed independently, each primed with the
+	32 KB before it, and joined into one zlib stream.
+*/
+#define IMAGE_PNG_BLOCK (1 << 17)
+
+/*
+	zlib compression level of PNG images (1 to 9).
+*/
+#define IMAGE_PNG_LEVEL 6
+
+/*
+	How an image is written, chosen from the extension of its path.
+	Formats that are not written natively are encoded by ffmpeg.
+*/
+enum class ImageFormat {
+	Ppm,								/* binary PPM (.ppm) */
+	Qoi,								/* Quite OK Image (.qoi) */
+	Png,								/* PNG (.png) */
+	Ffmpeg								/* anything else, through ffmpeg */
+};
+
+/*
+	Writes an image a band of rows at a time, as they are rendered.
+	Rows are 8-bit RGB, top to bottom.
+*/
+struct ImageWriter {
+	ImageFormat format;					/* how the image is written */
+	unsigned width, height;				/* image resolution */
+	unsigned rows;						/* rows written so far */
+	unsigned threads;					/* threads PNG rows are filtered and compressed on */
+	FILE* file;							/* file written natively */
+	EncoderPipe pipe;					/* pipe to ffmpeg otherwise */
+	unsigned char qoi_index[64 * 4];	/* QOI: RGBA colors by hash */
+	unsigned char qoi_previous[3];		/* QOI: previous pixel */
+	unsigned qoi_run;					/* QOI: pixels repeating the previous one */
+	std::vector<unsigned char> above;	/* PNG: last row written, which the next is filtered against */
+	std::vector<unsigned char> window;	/* PNG: last 32 KB of filtered rows */
+	unsigned long adler;				/* PNG: checksum of the filtered rows */
+};
+
+/*
+	Format an image at the given path is written in.
+*/
+ImageFormat image_format(const std::string& path);
+
+/*
+	Create an image of the given resolution, in the format its path
+	calls for. PNG rows are filtered and compressed on `threads` 
+	threads.
+*/
+void image_start(ImageWriter& writer, const std::string& path, unsigned width, unsigned height, unsigned threads);
+
+/*
+	Write the next `count` rows of the image.
+*/
+void image_write(ImageWriter& writer, const unsigned char* pixels, unsigned count);
+
+/*
+	Finish and close the image once every row is written.
+*/
+void image_end(ImageWriter& writer);
@@ -7,6 +7,9 @@
 #include "./mandelbrot.hpp"
 #include <cstdlib>
 #include <cstring>
+#include <vector>
+#include <atomic>
+#include <algorithm>
 
 void mandelbrot_start(
 	MandelbrotGlobals& globals,
@@ -18,16 +21,23 @@ void mandelbrot_start(
 	const char* imag,
 	const char* zoom,
 	unsigned prec,
-	const char* ezoom 
+	const char* ezoom,
+	const MandelbrotOptions& options 
 ) {
 	// For arbitrary precision reasons, some parameters are given 
 	// as strings.
 	globals.pixels = pixels;
 	globals.width = width;
 	globals.height = height;
+	globals.column_positions = globals.row_positions = nullptr;
+	globals.polar = false;
+	globals.aligned = false;
+	globals.known = nullptr;
+	globals.threads = 64;
 	globals.iterations = iterations;
 	globals.precision = prec;
 	globals.radius = 100.0;
+	globals.options = options;
 	mpfr_inits2(globals.precision,
 		globals.real, globals.imag,
 		globals.multiplier,
@@ -54,38 +64,28 @@ void mandelbrot_start(
 
 	// Set keyframe multipliers for zooms 
 	mpfr_set(globals.keyframe_multiplier, globals.start_multiplier, MPFR_RNDN);
-	mpfr_mul_d(globals.half_keyframe_multiplier, globals.keyframe_multiplier, 0.5, MPFR_RNDN);
+	mpfr_div_d(globals.half_keyframe_multiplier, globals.keyframe_multiplier, options.keyframe_ratio, MPFR_RNDN);
 
 	// Set multiplier that changes every frame rendered 
 	mpfr_set(globals.multiplier, globals.start_multiplier, MPFR_RNDN);
 
-	// Calculate all perturbation iterations 
-	mpfr_t z_re, z_im, z2_re, z2_im, temp;
-	mpfr_inits2(globals.precision, z_re, z_im, z2_re, z2_im, temp, (mpfr_ptr)0);
-	mpfr_set_zero(z_re, 0);
-	mpfr_set_zero(z_im, 0);
-	mpfr_set_zero(z2_re, 0);
-	mpfr_set_zero(z2_im, 0);
-	globals.perturbation = new Complex[globals.iterations];
-	globals.perturbation_iters = globals.iterations;
-	for (int i = 0; i < globals.iterations; ++i) {
-		globals.perturbation[i] = Complex{
-			mpfr_get_float128(z_re, MPFR_RNDN),
-			mpfr_get_float128(z_im, MPFR_RNDN)
-		};
-		mpfr_add(temp, z_re, z_re, MPFR_RNDN);
-		mpfr_fma(z_im, z_im, temp, globals.imag, MPFR_RNDN);
-		mpfr_sub(z_re, z2_re, z2_im, MPFR_RNDN);
-		mpfr_add(z_re, z_re, globals.real, MPFR_RNDN);
-		mpfr_sqr(z2_re, z_re, MPFR_RNDN);
-		mpfr_sqr(z2_im, z_im, MPFR_RNDN);
-		mpfr_add(temp, z2_re, z2_im, MPFR_RNDN);
-		if (mpfr_cmp_d(temp, globals.radius * globals.radius) > 0) {
-			globals.perturbation_iters = i + 1;
-			break;
-		}
-	}
-	mpfr_clears(z_re, z_im, z2_re, z2_im, temp, (mpfr_ptr)0);
+	// Start calculating the perturbation iterations in the background,
+	// rendering can begin as soon as the first ones are available. Views 
+	// that never get deeper than what doubles can handle do not need them.
+	if (mpfr_cmp_d(globals.start_multiplier, MANDELBROT_DIRECT_MULTIPLIER) < 0 ||
+		mpfr_cmp_d(globals.end_multiplier, MANDELBROT_DIRECT_MULTIPLIER) < 0)
+			orbit_start(globals.orbit, globals.real, globals.imag, globals.precision, globals.iterations, globals.radius,
+			globals.options.orbit_storage, globals.options.orbit_cache);
+}
+
+void mandelbrot_end(MandelbrotGlobals& globals) {
+	orbit_stop(globals.orbit);
+	mpfr_clears(
+		globals.real, globals.imag,
+		globals.multiplier,
+		globals.start_multiplier, globals.end_multiplier,
+		globals.keyframe_multiplier, globals.half_keyframe_multiplier,
+		(mpfr_ptr)0);
 }
 
 MANDELBROT_INLINE static void color(unsigned char& r, unsigned char& g, unsigned char& b, unsigned i, const Complex z) {
@@ -120,67 +120,701 @@ MANDELBROT_INLINE static void color(unsigned char& r, unsigned char& g, unsigned
 	b = palette[lookup0 + 2] + (palette[lookup1 + 2] - palette[lookup0 + 2]) * lerp;
 }
 
-void mandelbrot(const MandelbrotGlobals& globals) {
-	// Run on many threads as Mandelbrot set rendering is extremely parallel 
-	#pragma omp parallel num_threads(64)
+/*
+	Count a pixel that escaped at `iteration` into the statistics.
+*/
+MANDELBROT_INLINE static void stats_escape(MandelbrotStats& stats, unsigned iteration, unsigned limit) {
+	++stats.escaped;
+	++stats.histogram[std::min<unsigned long long>((unsigned long long)iteration * MANDELBROT_HISTOGRAM / limit, MANDELBROT_HISTOGRAM - 1)];
+	stats.max_escape = std::max(stats.max_escape, iteration);
+}
+
+/*
+	Add the statistics of one thread to those of the render.
+*/
+static void stats_merge(MandelbrotStats& stats, const MandelbrotStats& thread) {
+	#pragma omp critical(mandelbrot_stats)
 	{
-		// Allocate multiprecision values 
-		mpfr_t c_re, c_im, z_re, z_im, z2_re, z2_im, temp;
-		mpfr_inits2(globals.precision, c_re, c_im, z_re, z_im, z2_re, z2_im, temp, (mpfr_ptr)0);
-	
-		// Loop through each pixel of the image and apply the Mandelbrot set formula 
-		#pragma omp for
-		for (unsigned p = 0; p != globals.width * globals.height; ++p) {
-			// Calculate the delta with full precision 
-			mpfr_mul_d(c_re, globals.multiplier, (p % globals.width) - (globals.width * 0.5) + 0.5, MPFR_RNDN);
-			mpfr_mul_d(c_im, globals.multiplier, -((p / globals.width) - (globals.height * 0.5) + 0.5), MPFR_RNDN);
-
-			// Round it off to normal precision 
-			Complex dc{
-				mpfr_get_float128(c_re, MPFR_RNDN),
-				mpfr_get_float128(c_im, MPFR_RNDN)
-			}, dz{0, 0}, z{0, 0};
-
-			// Perform all iterations 
-			unsigned iteration = 0, ref_iteration = 0;
-			while (iteration < globals.iterations) {
-				const Complex ref = globals.perturbation[ref_iteration];
-				dz *= dz + ref + ref;
-				dz += dc;
-				++ref_iteration;
-
-				z = globals.perturbation[ref_iteration] + dz;
-				if (Real sqrlen = z.norm(); sqrlen > globals.radius * globals.radius)
+		stats.lane_steps += thread.lane_steps;
+		stats.lane_slots += thread.lane_slots;
+		stats.tile_pixels += thread.tile_pixels;
+		stats.escaped += thread.escaped;
+		stats.capped += thread.capped;
+		for (unsigned i = 0; i != MANDELBROT_HISTOGRAM; ++i)
+			stats.histogram[i] += thread.histogram[i];
+		stats.max_escape = std::max(stats.max_escape, thread.max_escape);
+	}
+}
+
+/*
+	Whether a point is inside the main cardioid or the period-2 bulb,
+	which are known to be part of the Mandelbrot set.
+*/
+MANDELBROT_INLINE static bool in_cardioid_or_bulb(const Complex c) {
+	const Real x = c.re - 0.25, y2 = c.im * c.im;
+	const Real q = x * x + y2;
+	if (q * (q + x) <= 0.25 * y2)
+		return true;
+	const Real x1 = c.re + 1.0;
+	return x1 * x1 + y2 <= 0.0625;
+}
+
+/*
+	Render the given rows of a shallow view by iterating every pixel 
+	with doubles.
+*/
+static void mandelbrot_direct(const MandelbrotGlobals& globals, const std::vector<unsigned>& rows, MandelbrotStats& stats) {
+	const Real center_re = mpfr_get_d(globals.real, MPFR_RNDN);
+	const Real center_im = mpfr_get_d(globals.imag, MPFR_RNDN);
+	const Real multiplier = mpfr_get_d(globals.multiplier, MPFR_RNDN);
+
+	#pragma omp parallel num_threads(globals.threads.load())
+	{
+		MandelbrotStats thread{};
+		#pragma omp for schedule(dynamic, 64)
+		for (unsigned q = 0; q != rows.size() * globals.width; ++q) {
+			const unsigned p = (q % globals.width) + rows[q / globals.width] * globals.width;
+			if (globals.known != nullptr && globals.known[p])
+				continue;
+			const Complex position = mandelbrot_position(globals, p % globals.width, p / globals.width);
+			const Complex c{center_re + multiplier * position.re, center_im + multiplier * position.im};
+			Complex z{0, 0};
+
+			// Points in the largest components need no iterations at all 
+			unsigned iteration = 0;
+			if (in_cardioid_or_bulb(c))
+				goto noexplode;
+
+			for (; iteration < globals.iterations; ++iteration) {
+				z = z * z + c;
+				if (z.norm() > globals.radius * globals.radius)
 					goto explode;
-				else if (sqrlen < dz.norm() || ref_iteration >= globals.perturbation_iters) {
-					dz = z;
-					ref_iteration = 0;
-				}
-				++iteration;
 			}
 
-			// If the point does "not explode", that is, in the Mandelbrot set,
-			// color it black 
 			noexplode: {
+				thread.capped += iteration == globals.iterations;
 				globals.pixels[3 * p + 0] = 0x00;
 				globals.pixels[3 * p + 1] = 0x00;
 				globals.pixels[3 * p + 2] = 0x00;
 				continue;
 			}
 
-			// If the point does "explode", that is, it is not in the Mandelbrot set,
-			// color it dependent on the "color" function 
 			explode: {
 				unsigned char r, g, b;
 				color(r, g, b, iteration, z);
+				stats_escape(thread, iteration, globals.iterations);
 				globals.pixels[3 * p + 0] = r;
 				globals.pixels[3 * p + 1] = g;
 				globals.pixels[3 * p + 2] = b;
 			}
 		}
+		stats_merge(stats, thread);
+	}
+}
+
+/*
+	Generous bound on the relative rounding error of the few floating-
+	point operations that make up one step of a tile's model.
+*/
+static constexpr Real TILE_ROUNDING = 0x1p-48;
+
+/*
+	Magnitude of a complex number. Tiles never get near overflow, so 
+	this does not need the care of Complex::len.
+*/
+MANDELBROT_INLINE static Real tile_abs(const Complex z) {
+	return std::sqrt(z.norm());
+}
+
+/*
+	First-order Taylor model of the deltas of every pixel in a tile. A 
+	pixel whose dc is `f` away from the tile's center has delta 
+	
+		dz = delta + a * f + e,    |e| <= error 
+	
+	where `delta` is iterated exactly like the delta of a pixel at the 
+	tile's center, and `a` is its derivative with respect to dc.
+*/
+struct TileModel {
+	Complex delta;				/* delta at the tile's center */
+	Complex a;					/* derivative of the delta with respect to dc */
+	Real error;					/* bound on the error of the linear model */
+	unsigned ref;				/* index into the reference orbit */
+	unsigned iteration;			/* iterations done */
+};
+
+/*
+	What is known about every pixel of a tile.
+*/
+enum class TileClass {
+	Uncertain,					/* pixels have to be iterated one by one */
+	Interior,					/* every pixel is trapped by an attracting cycle */
+	Capped,						/* no pixel escapes before the iteration limit */
+	Escaped						/* every pixel escapes at the same iteration */
+};
+
+/*
+	Everything one thread needs to classify tiles.
+*/
+struct TileContext {
+	const MandelbrotGlobals& globals;
+	const std::vector<unsigned>& rows;	/* rows being rendered */
+	unsigned char* certified;			/* whether each pixel is done */
+	OrbitCursor cursor;					/* this thread's view of the reference orbit */
+	unsigned available;					/* cached readable length of the orbit */
+	Real multiplier;					/* multiplier, rounded off */
+	mpfr_t c_re{}, c_im{};				/* multiprecision scratch */
+	unsigned long long pixels = 0;		/* pixels certified by this thread */
+	MandelbrotStats stats{};			/* escapes of the pixels certified by this thread */
+};
+
+/*
+	Advance a tile's model by one iteration, rebasing it the way a pixel 
+	at its center would. Afterwards, the full value of every pixel of 
+	the tile lies in the disk of radius `spread` around `center`.
+
+	Like the perturbation kernel, this takes the stored reference orbit 
+	to be exact. Only the rounding of the model itself is accounted for.
+*/
+static void tile_step(TileContext& context, TileModel& model, const Complex dc, Real rho, Complex& center, Real& spread) {
+	const Complex z_ref = orbit_at(context.cursor, model.ref);
+	const Complex z_next = orbit_at(context.cursor, model.ref + 1);
+
+	// With dz = delta + a * f + e, the next delta is 
+	//    delta * (delta + 2Z) + dc + (2 * (delta + Z) * a + 1) * f 
+	// plus a remainder of (a * f)^2 + 2e * (delta + a * f + Z) + e^2 
+	const Real delta = tile_abs(model.delta), linear = tile_abs(model.a) * rho, z = tile_abs(z_ref);
+	const Real sum = tile_abs(model.delta + z_ref);
+	const Real rounding = TILE_ROUNDING * (delta * (delta + 2.0 * z) + tile_abs(dc) + (2.0 * (delta + z) * tile_abs(model.a) + 1.0) * rho);
+	model.error = (linear * linear + 2.0 * model.error * (sum + linear) + model.error * model.error + rounding) * (1.0 + TILE_ROUNDING);
+	model.a = 2.0 * (model.delta + z_ref) * model.a + 1.0;
+	model.delta = model.delta * (model.delta + z_ref + z_ref) + dc;
+
+	center = z_next + model.delta;
+	const Real slack = TILE_ROUNDING * tile_abs(center);
+	spread = (tile_abs(model.a) * rho + model.error + slack) * (1.0 + TILE_ROUNDING);
+
+	// Rebasing only moves the delta onto another reference point 
+	if (center.norm() < model.delta.norm() || !orbit_has(context.globals.orbit, context.available, model.ref + 2)) {
+		model.delta = center;
+		model.error = (model.error + slack) * (1.0 + TILE_ROUNDING);
+		model.ref = 0;
+	} else 
+		++model.ref;
+}
+
+/*
+	Check whether the disk of radius `spread` around `center`, which 
+	holds the tile's values, lies in a trap that `period` iterations 
+	map into itself for every dc of the tile. If so, no pixel of the 
+	tile ever escapes.
+*/
+static bool tile_trapped(TileContext& context, const TileModel& model, const Complex dc, Real rho, const Complex center, Real spread, unsigned period) {
+	const Real trap = spread * MANDELBROT_TILE_TRAP_SCALE;
+	TileModel ball = model;
+	ball.a = Complex{0, 0};
+	ball.error = trap + spread - tile_abs(model.a) * rho - model.error;
+	for (unsigned i = 0; i != period; ++i) {
+		Complex next;
+		Real next_spread;
+		tile_step(context, ball, dc, rho, next, next_spread);
+		if (tile_abs(next) + next_spread >= context.globals.radius)
+			return false;
+		if (i + 1 == period)
+			return tile_abs(next - center) * (1.0 + TILE_ROUNDING) + next_spread <= trap * (1.0 - TILE_ROUNDING);
+	}
+	return false;
+}
+
+/*
+	Iterate the disk of every dc within `rho` of `dc` with ball 
+	arithmetic, starting from `model`, until it is known whether all 
+	of it escapes at the same iteration, none of it escapes, or 
+	neither. Afterwards, `snapshot` is the last model precise enough 
+	to continue pixels from.
+*/
+static TileClass tile_classify(TileContext& context, TileModel model, const Complex dc, Real rho, TileModel& snapshot) {
+	const Real radius = context.globals.radius;
+	snapshot = model;
+
+	// Attracting cycles bring the values back close to where they were 
+	// every period, which shows as new minimums of their size. Once a 
+	// period is known, traps are tried at growing intervals, as the 
+	// values take a while to settle onto the cycle 
+	Real best = INFINITY;
+	unsigned best_iteration = 0, period = 0, traps = 0;
+	unsigned long long next_trap = 0;
+	while (model.iteration != context.globals.iterations) {
+		Complex center;
+		Real spread;
+		tile_step(context, model, dc, rho, center, spread);
+		const Real distance = tile_abs(center);
+		if (distance - spread > radius * (1.0 + TILE_ROUNDING))
+			return TileClass::Escaped;
+		if (distance + spread >= radius * (1.0 - TILE_ROUNDING))
+			return TileClass::Uncertain;
+		++model.iteration;
+		if (model.error <= MANDELBROT_TILE_TOLERANCE * tile_abs(model.delta))
+			snapshot = model;
+
+		if (distance < best) {
+			if (best_iteration != 0) {
+				if (period == 0)
+					next_trap = model.iteration;
+				period = model.iteration - best_iteration;
+			}
+			best = distance;
+			best_iteration = model.iteration;
+		}
+		if (model.iteration == next_trap && traps != MANDELBROT_TILE_TRAPS) {
+			if (tile_trapped(context, model, dc, rho, center, spread, period))
+				return TileClass::Interior;
+			next_trap += (unsigned long long)period << traps++;
+		}
+	}
+	return TileClass::Capped;
+}
+
+/*
+	Finish a pixel of an escaping tile by continuing from the tile's 
+	model, exactly like the perturbation kernel would.
+*/
+static void tile_finish(TileContext& context, const TileModel& model, const Complex dc, const Complex f, unsigned p) {
+	const MandelbrotGlobals& globals = context.globals;
+	Complex dz = model.delta + model.a * f;
+	unsigned ref = model.ref, iteration = model.iteration;
+	for (; iteration != globals.iterations; ++iteration) {
+		const Complex z_ref = orbit_at(context.cursor, ref);
+		dz = dz * (dz + z_ref + z_ref) + dc;
+		const Complex z = orbit_at(context.cursor, ref + 1) + dz;
+		if (z.norm() > globals.radius * globals.radius) {
+			unsigned char r, g, b;
+			color(r, g, b, iteration, z);
+			stats_escape(context.stats, iteration, globals.iterations);
+			globals.pixels[3 * p + 0] = r;
+			globals.pixels[3 * p + 1] = g;
+			globals.pixels[3 * p + 2] = b;
+			return;
+		}
+		if (z.norm() < dz.norm() || !orbit_has(globals.orbit, context.available, ref + 2)) {
+			dz = z;
+			ref = 0;
+		} else 
+			++ref;
+	}
+	++context.stats.capped;
+	globals.pixels[3 * p + 0] = 0x00;
+	globals.pixels[3 * p + 1] = 0x00;
+	globals.pixels[3 * p + 2] = 0x00;
+}
+
+/*
+	Classify the tile of columns [x0, x1) and of rows rows[i0 .. i1), 
+	and render its pixels if that succeeds. Otherwise, split it.
+
+	The tile starts from the model of the tile it was split from, 
+	recentered on its own center. That model holds for every pixel of 
+	the parent, so it holds for the smaller tile as well.
+*/
+static void mandelbrot_tile(TileContext& context, const TileModel& parent, const Complex parent_dc, unsigned x0, unsigned x1, unsigned i0, unsigned i1) {
+	const MandelbrotGlobals& globals = context.globals;
+	const Real m = context.multiplier;
+
+	// Bound the tile's pixels with a box. Pixels of a polar grid are 
+	// not ordered like those of a rectangular one, so every one of 
+	// them is looked at 
+	Complex lo{INFINITY, INFINITY}, hi{-INFINITY, -INFINITY};
+	for (unsigned i = i0; i != i1; ++i)
+		for (unsigned px = x0; px != x1; ++px) {
+			const Complex position = mandelbrot_position(globals, px, context.rows[i]);
+			lo.re = std::min(lo.re, position.re), hi.re = std::max(hi.re, position.re);
+			lo.im = std::min(lo.im, position.im), hi.im = std::max(hi.im, position.im);
+		}
+	const Real x = 0.5 * (lo.re + hi.re), y = 0.5 * (lo.im + hi.im);
+
+	// The disk around the center's dc must hold the dc of every pixel, 
+	// including what rounding them off moved them by 
+	mpfr_mul_d(context.c_re, globals.multiplier, x, MPFR_RNDN);
+	mpfr_mul_d(context.c_im, globals.multiplier, y, MPFR_RNDN);
+	const Complex dc{mpfr_get_d(context.c_re, MPFR_RNDN), mpfr_get_d(context.c_im, MPFR_RNDN)};
+	const Real half = m * std::hypot(0.5 * (hi.re - lo.re), 0.5 * (hi.im - lo.im));
+	const Real rho = (half + TILE_ROUNDING * (tile_abs(dc) + half)) * (1.0 + TILE_ROUNDING);
+
+	TileModel model = parent, snapshot;
+	const Complex offset = parent.a * (dc - parent_dc);
+	model.delta = parent.delta + offset;
+	model.error = (parent.error + TILE_ROUNDING * (tile_abs(parent.delta) + tile_abs(offset))) * (1.0 + TILE_ROUNDING);
+
+	const TileClass type = tile_classify(context, model, dc, rho, snapshot);
+	if (type == TileClass::Uncertain) {
+		if (x1 - x0 <= MANDELBROT_TILE_MIN && i1 - i0 <= MANDELBROT_TILE_MIN)
+			return;
+		const unsigned xm = x0 + (x1 - x0 + 1) / 2, im = i0 + (i1 - i0 + 1) / 2;
+		mandelbrot_tile(context, snapshot, dc, x0, xm, i0, im);
+		if (xm != x1)
+			mandelbrot_tile(context, snapshot, dc, xm, x1, i0, im);
+		if (im != i1) {
+			mandelbrot_tile(context, snapshot, dc, x0, xm, im, i1);
+			if (xm != x1)
+				mandelbrot_tile(context, snapshot, dc, xm, x1, im, i1);
+		}
+		return;
+	}
+
+	// Pixels that are already certified were known before rendering 
+	for (unsigned i = i0; i != i1; ++i)
+		for (unsigned px = x0; px != x1; ++px) {
+			const unsigned p = px + context.rows[i] * globals.width;
+			if (context.certified[p])
+				continue;
+			if (type != TileClass::Escaped) {
+				context.stats.capped += type == TileClass::Capped;
+				globals.pixels[3 * p + 0] = 0x00;
+				globals.pixels[3 * p + 1] = 0x00;
+				globals.pixels[3 * p + 2] = 0x00;
+			} else {
+				const Complex position = mandelbrot_position(globals, px, context.rows[i]);
+				const Complex f{(position.re - x) * m, (position.im - y) * m};
+				tile_finish(context, snapshot, dc + f, f, p);
+			}
+			context.certified[p] = 1;
+			++context.pixels;
+		}
+}
+
+/*
+	Classify the tiles of the given rows of a deep view, render the 
+	ones that could be classified, and collect the pixels of the other 
+	ones into `pending`. Returns how many pixels were rendered.
+*/
+static unsigned long long mandelbrot_tiles(const MandelbrotGlobals& globals, const std::vector<unsigned>& rows, std::vector<unsigned>& pending, MandelbrotStats& stats) {
+	const unsigned columns = (globals.width + MANDELBROT_TILE - 1) / MANDELBROT_TILE;
+	const unsigned tiles = columns * ((rows.size() + MANDELBROT_TILE - 1) / MANDELBROT_TILE);
+	std::vector<unsigned char> certified(globals.width * globals.height, 0);
+	if (globals.known != nullptr)
+		std::copy(globals.known, globals.known + certified.size(), certified.begin());
+	unsigned long long pixels = 0;
+
+	if (globals.iterations != 0) {
+		#pragma omp parallel num_threads(globals.threads.load()) reduction(+:pixels)
+		{
+			TileContext context{globals, rows, certified.data(), orbit_cursor(globals.orbit), 0, mpfr_get_d(globals.multiplier, MPFR_RNDN)};
+			mpfr_inits2(globals.precision, context.c_re, context.c_im, (mpfr_ptr)0);
+			orbit_has(globals.orbit, context.available, 1);
+
+			// The cursor is released after every tile, so that no thread 
+			// keeps a segment pinned while it waits at the barrier for 
+			// threads that need room in the orbit cache 
+			#pragma omp for schedule(dynamic, 1)
+			for (unsigned t = 0; t < tiles; ++t) {
+				const unsigned x0 = (t % columns) * MANDELBROT_TILE, i0 = (t / columns) * MANDELBROT_TILE;
+				mandelbrot_tile(context, TileModel{}, Complex{0, 0}, x0, std::min(x0 + MANDELBROT_TILE, globals.width), 
+					i0, std::min<unsigned>(i0 + MANDELBROT_TILE, rows.size()));
+				orbit_release(context.cursor);
+			}
+			pixels += context.pixels;
+			stats_merge(stats, context.stats);
+
+			mpfr_clears(context.c_re, context.c_im, (mpfr_ptr)0);
+			mpfr_free_cache();
+		}
+	}
+
+	for (const unsigned y : rows)
+		for (unsigned x = 0; x != globals.width; ++x)
+			if (!certified[x + y * globals.width])
+				pending.push_back(x + y * globals.width);
+	return pixels;
+}
+
+/*
+	Pixels being iterated by one thread of the perturbation kernel, in 
+	SoA layout so that each iteration step is vectorized across lanes. 
+	Every block, each lane copies the window of reference orbit points 
+	it needs, so that the step itself only reads contiguous memory.
+*/
+struct alignas(64) LanePool {
+	Real dz_re[MANDELBROT_LANES], dz_im[MANDELBROT_LANES];			/* current deltas */
+	Real dc_re[MANDELBROT_LANES], dc_im[MANDELBROT_LANES];			/* pixel deltas */
+	Real z_re[MANDELBROT_LANES], z_im[MANDELBROT_LANES];			/* full value after the last step */
+	Real window_re[MANDELBROT_BLOCK + 1][MANDELBROT_LANES];		/* reference points of this block */
+	Real window_im[MANDELBROT_BLOCK + 1][MANDELBROT_LANES];
+
+	// Counters and flags are as wide as a Real, so that every field 
+	// of a lane fits the same vector register layout 
+	unsigned long long iteration[MANDELBROT_LANES];				/* iterations done */
+	unsigned long long ref_iteration[MANDELBROT_LANES];			/* index into the reference orbit */
+	unsigned long long length[MANDELBROT_LANES];					/* reference points in the window */
+	unsigned long long running[MANDELBROT_LANES];					/* whether the lane steps this block */
+	unsigned long long escaped[MANDELBROT_LANES];					/* whether the pixel escaped */
+	unsigned long long ended[MANDELBROT_LANES];					/* whether the orbit ends in the window */
+	unsigned pixel[MANDELBROT_LANES];								/* pixel the lane belongs to */
+	bool occupied[MANDELBROT_LANES];								/* whether the lane has a pixel */
+};
+
+/*
+	Render the given pixels of a deep view with perturbation against 
+	the reference orbit.
+
+	Each thread keeps MANDELBROT_LANES pixels in flight and steps them 
+	together in blocks of MANDELBROT_BLOCK iterations. A lane stops for 
+	the rest of a block when its pixel escapes, finishes, rebases or 
+	runs out of reference points, and the block ends early once most 
+	lanes stopped. After every block, lanes whose pixel is done are 
+	refilled from the shared queue of pending pixels, and the others 
+	get a new window. That way, one slow pixel does not hold the other 
+	lanes hostage.
+*/
+static MandelbrotStats mandelbrot_perturbation(const MandelbrotGlobals& globals, const std::vector<unsigned>& pixels) {
+	const unsigned total = pixels.size();
+	const Real r2 = globals.radius * globals.radius;
+	std::atomic<unsigned> pending{0};
+	MandelbrotStats stats{};
+
+	// Run on many threads as Mandelbrot set rendering is extremely parallel 
+	#pragma omp parallel num_threads(globals.threads.load())
+	{
+		// Allocate multiprecision values 
+		mpfr_t c_re, c_im;
+		mpfr_inits2(globals.precision, c_re, c_im, (mpfr_ptr)0);
+
+		// The lanes read the reference orbit through one cursor, which 
+		// only pins a segment while their windows are copied, so that a 
+		// thread holds at most one segment of a checkpointed orbit 
+		LanePool pool;
+		OrbitCursor cursor = orbit_cursor(globals.orbit);
+		for (unsigned l = 0; l != MANDELBROT_LANES; ++l)
+			pool.occupied[l] = false;
+		unsigned available = 0;
+		if (globals.iterations != 0)
+			orbit_has(globals.orbit, available, 1);
+
+		// Pending pixels are taken from the shared queue a batch at a time 
+		unsigned next = 0, last = 0;
+		MandelbrotStats thread{};
+		bool drained = globals.iterations == 0;
+		if (drained)
+			for (unsigned q = pending.fetch_add(total); q < total; ++q) {
+				const unsigned p = pixels[q];
+				globals.pixels[3 * p + 0] = globals.pixels[3 * p + 1] = globals.pixels[3 * p + 2] = 0x00;
+			}
+
+		while (true) {
+			// Refill the lanes that are free, and copy the reference 
+			// window every occupied lane needs for this block 
+			unsigned occupied = 0;
+			for (unsigned l = 0; l != MANDELBROT_LANES; ++l) {
+				if (!pool.occupied[l] && !drained) {
+					if (next == last) {
+						next = pending.fetch_add(MANDELBROT_BLOCK);
+						last = std::min(next + MANDELBROT_BLOCK, total);
+						next = std::min(next, total);
+					}
+					if (next == last)
+						drained = true;
+					else {
+						const unsigned p = pixels[next++];
+
+						// Calculate the delta with full precision, then 
+						// round it off to normal precision 
+						const Complex position = mandelbrot_position(globals, p % globals.width, p / globals.width);
+						mpfr_mul_d(c_re, globals.multiplier, position.re, MPFR_RNDN);
+						mpfr_mul_d(c_im, globals.multiplier, position.im, MPFR_RNDN);
+						pool.dc_re[l] = mpfr_get_float128(c_re, MPFR_RNDN);
+						pool.dc_im[l] = mpfr_get_float128(c_im, MPFR_RNDN);
+						pool.dz_re[l] = pool.dz_im[l] = 0.0;
+						pool.z_re[l] = pool.z_im[l] = 0.0;
+						pool.iteration[l] = pool.ref_iteration[l] = 0;
+						pool.pixel[l] = p;
+						pool.escaped[l] = 0;
+						pool.occupied[l] = true;
+					}
+				}
+
+				pool.running[l] = pool.occupied[l];
+				pool.length[l] = 0;
+				pool.ended[l] = 0;
+				if (!pool.occupied[l])
+					continue;
+				++occupied;
+
+				// There always are at least two points in the window, as 
+				// a pixel rebases as soon as the orbit has no next point 
+				const unsigned ref = pool.ref_iteration[l];
+				unsigned j = 0;
+
+				// Most windows lie in one segment, so copy them without
+				// looking up the segment of every point
+				if (orbit_has(globals.orbit, available, ref + MANDELBROT_BLOCK) &&
+					(ref >> ORBIT_SEGMENT_SHIFT) == ((ref + MANDELBROT_BLOCK) >> ORBIT_SEGMENT_SHIFT)) {
+					const OrbitSegment& segment = orbit_segment_of(cursor, ref);
+					const unsigned offset = ref & ORBIT_SEGMENT_MASK;
+					if (segment.single) {
+						const float* points = (const float*)segment.points + 2 * offset;
+						for (; j <= MANDELBROT_BLOCK; ++j) {
+							pool.window_re[j][l] = points[2 * j + 0];
+							pool.window_im[j][l] = points[2 * j + 1];
+						}
+					} else {
+						const Complex* points = (const Complex*)segment.points + offset;
+						for (; j <= MANDELBROT_BLOCK; ++j) {
+							pool.window_re[j][l] = points[j].re;
+							pool.window_im[j][l] = points[j].im;
+						}
+					}
+				}
+				for (; j <= MANDELBROT_BLOCK && orbit_has(globals.orbit, available, ref + j); ++j) {
+					const Complex point = orbit_at(cursor, ref + j);
+					pool.window_re[j][l] = point.re;
+					pool.window_im[j][l] = point.im;
+				}
+				orbit_prefetch(cursor, ref + j - 1);
+				pool.length[l] = j;
+				pool.ended[l] = j <= MANDELBROT_BLOCK;
+			}
+			orbit_release(cursor);
+			if (occupied == 0)
+				break;
+
+			// Step every running lane through the block at once (lanes 
+			// are independent, which lets GCC vectorize across them) 
+			unsigned long long block_steps = 0;
+			for (unsigned k = 0; k != MANDELBROT_BLOCK; ++k) {
+				const unsigned long long previous_steps = block_steps;
+				#pragma GCC ivdep
+				for (unsigned l = 0; l < MANDELBROT_LANES; ++l) {
+					const Real ref_re = pool.window_re[k][l], ref_im = pool.window_im[k][l];
+					const Real dz_re = pool.dz_re[l], dz_im = pool.dz_im[l];
+					const Real t_re = dz_re + ref_re + ref_re, t_im = dz_im + ref_im + ref_im;
+					const Real n_re = dz_re * t_re - dz_im * t_im + pool.dc_re[l];
+					const Real n_im = dz_re * t_im + dz_im * t_re + pool.dc_im[l];
+					const Real z_re = pool.window_re[k + 1][l] + n_re, z_im = pool.window_im[k + 1][l] + n_im;
+					const Real sqrlen = z_re * z_re + z_im * z_im;
+
+					// A pixel rebases when its full value gets smaller than 
+					// its delta, or when the orbit has no next point 
+					const bool running = pool.running[l];
+					const bool escape = sqrlen > r2;
+					const bool window_end = k + 2 == pool.length[l];
+					const bool rebase = !escape && (sqrlen < n_re * n_re + n_im * n_im || (window_end && pool.ended[l]));
+					const unsigned long long iteration = pool.iteration[l] + (escape ? 0 : 1);
+
+					pool.dz_re[l] = running ? (rebase ? z_re : n_re) : dz_re;
+					pool.dz_im[l] = running ? (rebase ? z_im : n_im) : dz_im;
+					pool.z_re[l] = running ? z_re : pool.z_re[l];
+					pool.z_im[l] = running ? z_im : pool.z_im[l];
+					pool.ref_iteration[l] = running ? (rebase ? 0 : pool.ref_iteration[l] + 1) : pool.ref_iteration[l];
+					pool.iteration[l] = running ? iteration : pool.iteration[l];
+					pool.escaped[l] |= running & escape;
+					pool.running[l] = running & !escape & !rebase & !window_end & (iteration != globals.iterations);
+					block_steps += running;
+				}
+
+				// End the block once most lanes stopped, so that they 
+				// are refilled instead of idling 
+				if (2 * (block_steps - previous_steps) < occupied)
+					break;
+			}
+			thread.lane_steps += block_steps;
+			thread.lane_slots += MANDELBROT_BLOCK * MANDELBROT_LANES;
+
+			// Scatter the pixels that are done back to the image 
+			for (unsigned l = 0; l != MANDELBROT_LANES; ++l) {
+				if (!pool.occupied[l])
+					continue;
+				const unsigned p = pool.pixel[l];
+
+				// If the point does "explode", that is, it is not in the 
+				// Mandelbrot set, color it dependent on the "color" function 
+				if (pool.escaped[l]) {
+					unsigned char r, g, b;
+					color(r, g, b, pool.iteration[l], Complex{pool.z_re[l], pool.z_im[l]});
+					stats_escape(thread, pool.iteration[l], globals.iterations);
+					globals.pixels[3 * p + 0] = r;
+					globals.pixels[3 * p + 1] = g;
+					globals.pixels[3 * p + 2] = b;
+					pool.occupied[l] = false;
+				}
+
+				// If the point does "not explode", that is, in the 
+				// Mandelbrot set, color it black 
+				else if (pool.iteration[l] == globals.iterations) {
+					++thread.capped;
+					globals.pixels[3 * p + 0] = 0x00;
+					globals.pixels[3 * p + 1] = 0x00;
+					globals.pixels[3 * p + 2] = 0x00;
+					pool.occupied[l] = false;
+				}
+			}
+		}
+		stats_merge(stats, thread);
 
 		// Free cache and all multiprecision variables 
-		mpfr_clears(c_re, c_im, z_re, z_im, z2_re, z2_im, temp, (mpfr_ptr)0);
+		orbit_release(cursor);
+		mpfr_clears(c_re, c_im, (mpfr_ptr)0);
 		mpfr_free_cache();
 	}
+
+	return stats;
+}
+
+/*
+	Find the row sum S such that rows y and S - y are mirror images of 
+	each other across the real axis. With row y at y - c below the 
+	center, rows are mirrored when 
+	
+		imag - m * (y - c) = -(imag - m * (S - y - c))
+	
+	which holds for every y exactly when 2 * imag / m + 2c = S is an 
+	integer, where 2c is h - 1, or twice h/2 rounded down on an aligned 
+	grid. Returns false if it is not, if no rows are mirrored, or if 
+	rows are not spaced uniformly.
+*/
+static bool mirror_sum(const MandelbrotGlobals& globals, long& sum) {
+	if (globals.row_positions != nullptr)
+		return false;
+	mpfr_t axis;
+	mpfr_init2(axis, globals.precision);
+	const bool exact = mpfr_div(axis, globals.imag, globals.multiplier, MPFR_RNDN) == 0;
+	mpfr_mul_2si(axis, axis, 1, MPFR_RNDN);
+	const bool found = exact && mpfr_integer_p(axis) && mpfr_cmp_d(axis, 2.0 * globals.height) < 0 &&
+		mpfr_cmp_d(axis, -2.0 * globals.height) > 0;
+	if (found)
+		sum = (long)mpfr_get_d(axis, MPFR_RNDN) + (globals.aligned ? 2 * (globals.height / 2) : globals.height - 1);
+	mpfr_clear(axis);
+	return found;
+}
+
+MandelbrotStats mandelbrot(const MandelbrotGlobals& globals) {
+	// When the view straddles the real axis, only iterate one side of 
+	// it and copy the rows on the other side, as the Mandelbrot set is 
+	// symmetric under conjugation 
+	std::vector<unsigned> rows;
+	std::vector<unsigned> mirrored;
+	long sum = 0;
+	const bool symmetric = mirror_sum(globals, sum);
+	for (unsigned y = 0; y != globals.height; ++y) {
+		const long mirror = sum - (long)y;
+		if (symmetric && mirror >= 0 && mirror < (long)y)
+			mirrored.push_back(y);
+		else 
+			rows.push_back(y);
+	}
+
+	// Deep views only iterate the pixels of tiles that could not be 
+	// classified as a whole 
+	MandelbrotStats stats{};
+	if (mpfr_cmp_d(globals.multiplier, MANDELBROT_DIRECT_MULTIPLIER) >= 0)
+		mandelbrot_direct(globals, rows, stats);
+	else {
+		std::vector<unsigned> pending;
+		stats.tile_pixels = mandelbrot_tiles(globals, rows, pending, stats);
+		stats_merge(stats, mandelbrot_perturbation(globals, pending));
+	}
+
+	for (const unsigned y : mirrored)
+		memcpy(globals.pixels + 3 * y * globals.width,
+			   globals.pixels + 3 * (sum - y) * globals.width,
+			   3 * globals.width);
+	return stats;
 }
\ No newline at end of file
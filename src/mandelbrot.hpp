@@ -6,12 +6,77 @@
  */
 #pragma once
 #include "datatypes.hpp"
+#include "orbit.hpp"
+#include "frame.hpp"
+#include <string>
+#include <vector>
 
 /*
 	Some useful optimization macros 
 */
 #define MANDELBROT_INLINE __attribute__((always_inline)) inline 
 
+/*
+	Number of pixels every thread of the perturbation kernel iterates 
+	at once (SIMD lanes), and the number of iterations they are stepped 
+	together before finished lanes are refilled (a block ends early once 
+	less than half of its lanes still step).
+*/
+#define MANDELBROT_LANES 16
+#define MANDELBROT_BLOCK 64
+
+/*
+	Deep views are first split into tiles of MANDELBROT_TILE pixels 
+	squared, which are classified as a whole with ball arithmetic. 
+	Tiles that cannot be classified are split in four until they are 
+	MANDELBROT_TILE_MIN pixels across, and then rendered per pixel.
+*/
+#define MANDELBROT_TILE 16
+#define MANDELBROT_TILE_MIN 8
+
+/*
+	Number of times a tile tries to prove that it is trapped by an 
+	attracting cycle, and how much larger the trap is than the disk 
+	the tile's values are known to be in.
+*/
+#define MANDELBROT_TILE_TRAPS 16
+#define MANDELBROT_TILE_TRAP_SCALE 4.0
+
+/*
+	Pixels of an escaping tile continue from the tile's linear model 
+	at the last iteration where the model's error was at most this 
+	fraction of the delta, which is about what iterating them with 
+	doubles from the start would be off by anyway.
+*/
+#define MANDELBROT_TILE_TOLERANCE 1e-13
+
+/*
+	Views whose multiplier is at least this large are rendered by 
+	iterating every pixel directly with doubles, as that is precise 
+	enough there and needs no reference orbit.
+*/
+#define MANDELBROT_DIRECT_MULTIPLIER 1e-12
+
+/*
+	Options that tune how the renderer works rather than what it 
+	renders. Every option has a sensible default.
+*/
+struct MandelbrotOptions {
+	OrbitStorage orbit_storage = OrbitStorage::Double;	/* how the reference orbit is stored */
+	size_t orbit_cache = 0;								/* bytes of a checkpointed orbit kept resident (0 keeps all of it) */
+	unsigned keyframe_buffers = 0;						/* video keyframes held at once (2 renders them serially, 0 picks by memory) */
+	unsigned frame_buffers = 0;							/* video frames synthesized at once (1 uses every thread per frame, 0 picks by threads) */
+	double keyframe_ratio = 2.0;						/* zoom between video keyframes, which are this much larger than frames */
+	bool foveated_keyframes = false;					/* render video keyframes sparser away from their center */
+	bool exponential_map = false;						/* render videos from a log-polar strip instead of keyframes */
+	std::string keyframe_cache;							/* directory video keyframes are cached in (empty for none) */
+	bool zoom_out = false;								/* assemble videos zooming out instead of in */
+	unsigned min_iterations = 0;						/* lowest iteration limit of video keyframes, which adapt to what they need (0 keeps it fixed) */
+	size_t memory_budget = 0;							/* bytes of pixel buffers a render may hold (0 for no limit) */
+	FrameFormat pipe_format = FrameFormat::Yuv420;		/* pixel format of video frames piped to ffmpeg */
+	unsigned segments = 1;								/* contiguous parts a video is encoded in by separate ffmpegs, then joined */
+};
+
 /*
 	Struct that holds all arguments of the Mandelbrot renderer.
 	The file "base.cpp" is allowed to interact with the specifics 
@@ -24,18 +89,89 @@ struct MandelbrotGlobals {
 	unsigned iterations;				/* iteration count */
 	unsigned precision;					/* precision in bits */
 	Real radius;						/* escape radius */
+	MandelbrotOptions options;			/* renderer tuning options */
 	mpfr_t real;						/* starting real position */
 	mpfr_t imag;						/* starting imag position */
 	mpfr_t multiplier;					/* multiplier (inverse magnification) */
-	Complex* perturbation;				/* perturbation iterations */
-	unsigned perturbation_iters;		/* number of perturbation iterations */
+	const double* column_positions;		/* position of every column relative to the center (null for a uniform grid) */
+	const double* row_positions;		/* position of every row relative to the center (null for a uniform grid) */
+	bool polar;							/* whether columns are angles and rows are radii */
+	bool aligned;						/* whether the center is on pixel (width / 2, height / 2), rounded down */
+	const unsigned char* known;			/* pixels that are already rendered and are skipped (null for none) */
+	std::atomic<unsigned> threads;		/* threads every parallel region of a render runs on */
+	ReferenceOrbit orbit;				/* perturbation reference orbit */
 
 	mpfr_t start_multiplier;			/* starting multiplier */
 	mpfr_t end_multiplier;				/* ending multiplier */
 	mpfr_t keyframe_multiplier;			/* keyframe multiplier */
-	mpfr_t half_keyframe_multiplier;	/* half keyframe multiplier */
+	mpfr_t half_keyframe_multiplier;	/* multiplier of the next keyframe (keyframe multiplier over the keyframe ratio) */
 };
 
+/*
+	Number of bins of the escape histogram, which splits the iteration 
+	limit into equal parts.
+*/
+#define MANDELBROT_HISTOGRAM 8
+
+/*
+	Statistics of one render. Pixels in the largest components, or that 
+	are trapped by an attracting cycle, are known to be interior and 
+	are neither escaped nor capped.
+*/
+struct MandelbrotStats {
+	unsigned long long lane_steps;		/* iterations done by the perturbation kernel's lanes */
+	unsigned long long lane_slots;		/* iterations its lanes could have done */
+	unsigned long long tile_pixels;		/* pixels whose tile was classified as a whole */
+	unsigned long long escaped;			/* pixels that escaped */
+	unsigned long long capped;			/* pixels iterated up to the iteration limit without escaping */
+	unsigned long long histogram[MANDELBROT_HISTOGRAM];	/* escaped pixels by the part of the limit they escaped in */
+	unsigned max_escape;				/* latest iteration a pixel escaped at */
+};
+
+/*
+	Fraction of SIMD lanes that did useful work, or 1 if no lanes 
+	were used.
+*/
+inline double mandelbrot_lane_utilization(const MandelbrotStats& stats) {
+	return stats.lane_slots == 0 ? 1.0 : (double)stats.lane_steps / stats.lane_slots;
+}
+
+/*
+	Position of pixel column x relative to the center of the view, in 
+	units of the multiplier. Pixels are spaced one multiplier apart, 
+	unless the grid was given other positions. The center is between 
+	the middle two pixels of an even size, unless the grid is aligned.
+*/
+MANDELBROT_INLINE Real mandelbrot_column(const MandelbrotGlobals& globals, unsigned x) {
+	if (globals.column_positions != nullptr)
+		return globals.column_positions[x];
+	return globals.aligned ? (Real)x - (Real)(globals.width / 2) : x - (globals.width * 0.5) + 0.5;
+}
+
+/*
+	Position of pixel row y below the center of the view, in units of 
+	the multiplier (the imaginary part of the pixel is minus that).
+*/
+MANDELBROT_INLINE Real mandelbrot_row(const MandelbrotGlobals& globals, unsigned y) {
+	if (globals.row_positions != nullptr)
+		return globals.row_positions[y];
+	return globals.aligned ? (Real)y - (Real)(globals.height / 2) : y - (globals.height * 0.5) + 0.5;
+}
+
+/*
+	Position of pixel (x, y) relative to the center of the view, in 
+	units of the multiplier. On a polar grid, column_positions holds 
+	the (cos, sin) pair of every column's angle and row_positions the 
+	radius of every row.
+*/
+MANDELBROT_INLINE Complex mandelbrot_position(const MandelbrotGlobals& globals, unsigned x, unsigned y) {
+	if (globals.polar) {
+		const Real r = globals.row_positions[y];
+		return Complex{r * globals.column_positions[2 * x], r * globals.column_positions[2 * x + 1]};
+	}
+	return Complex{mandelbrot_column(globals, x), -mandelbrot_row(globals, y)};
+}
+
 /*
 	Initialize the MandelbrotGlobals struct.
 */
@@ -49,11 +185,19 @@ void mandelbrot_start(
 	const char* imag,
 	const char* zoom,
 	unsigned prec,
-	const char* ezoom 
+	const char* ezoom,
+	const MandelbrotOptions& options 
 );
 
+/*
+	Stop the reference orbit and free everything that 
+	mandelbrot_start allocated (except the pixel array).
+*/
+void mandelbrot_end(MandelbrotGlobals& globals);
+
 /*
 	Given the arguments below, and any other information, render 
-	the Mandelbrot set to a pixel array.
+	the Mandelbrot set to a pixel array. Shallow views are iterated 
+	directly, deeper ones with perturbation.
 */
-void mandelbrot(const MandelbrotGlobals& globals);
\ No newline at end of file
+MandelbrotStats mandelbrot(const MandelbrotGlobals& globals);
\ No newline at end of file
@@ -0,0 +1,427 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#include "./orbit.hpp"
+#include "./base.hpp"
+#include <cstdlib>
+#include <cfloat>
+#include <climits>
+#include <algorithm>
+#include <functional>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+/*
+	Allocate memory for orbit points, which are read in the hot loop. 
+	It is aligned to, and padded to a multiple of, a huge page, and is 
+	backed by transparent huge pages where the platform supports them.
+*/
+static void* orbit_allocate(size_t bytes) {
+	const size_t alignment = ORBIT_HUGE_PAGE_SIZE;
+	bytes = (bytes + alignment - 1) & ~(alignment - 1);
+#if defined(_WIN32)
+	return _aligned_malloc(bytes, alignment);
+#else
+	void* memory = aligned_alloc(alignment, bytes);
+	#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if (memory != nullptr)
+		madvise(memory, bytes, MADV_HUGEPAGE);
+	#endif
+	return memory;
+#endif
+}
+
+static void orbit_free(void* memory) {
+#if defined(_WIN32)
+	_aligned_free(memory);
+#else
+	free(memory);
+#endif
+}
+
+/*
+	Allocate a segment for double or float values.
+*/
+static void orbit_segment_allocate(OrbitSegment& segment, bool single) {
+	const size_t size = single ? sizeof(float) : sizeof(Real);
+	segment.points = orbit_allocate(2 * size * ORBIT_SEGMENT_SIZE);
+	segment.single = single;
+	if (segment.points == nullptr)
+		fatal_error("Out of memory while storing the reference orbit");
+}
+
+/*
+	Whether a value survives conversion to a normal float. Only its 
+	range is checked, as the precision of floats does not depend on 
+	the depth (see OrbitStorage).
+*/
+static bool orbit_fits_float(Real value) {
+	const Real magnitude = std::abs(value);
+	return magnitude == 0 || (magnitude >= FLT_MIN && magnitude <= FLT_MAX);
+}
+
+/*
+	Store `count` staged points into a segment, as floats if the orbit 
+	storage and all of their values allow it and as doubles otherwise.
+*/
+static void orbit_segment_store(OrbitSegment& segment, const Complex* staged, unsigned count, OrbitStorage storage) {
+	bool single = storage == OrbitStorage::Float;
+	for (unsigned k = 0; k != count && single; ++k)
+		single = orbit_fits_float(staged[k].re) && orbit_fits_float(staged[k].im);
+
+	orbit_segment_allocate(segment, single);
+	if (single) {
+		float* points = (float*)segment.points;
+		for (unsigned k = 0; k != count; ++k) {
+			points[2 * k + 0] = staged[k].re;
+			points[2 * k + 1] = staged[k].im;
+		}
+	} else 
+		std::copy(staged, staged + count, (Complex*)segment.points);
+}
+
+/*
+	Free the least recently used segment of a checkpointed orbit that 
+	nobody reads from. Returns whether a segment was evicted. The orbit's 
+	mutex must be held.
+*/
+static bool orbit_evict(const ReferenceOrbit& orbit) {
+	OrbitSegment* victim = nullptr;
+	for (unsigned s = 1; s != orbit.segment_count; ++s) {
+		OrbitSegment& segment = orbit.segments[s];
+		if (segment.points != nullptr && segment.pins == 0 && !segment.loading)
+			if (victim == nullptr || segment.last_used < victim->last_used)
+				victim = &segment;
+	}
+	if (victim == nullptr)
+		return false;
+	orbit_free(victim->points);
+	victim->points = nullptr;
+	--orbit.resident;
+	return true;
+}
+
+/*
+	Make room for one more segment of a checkpointed orbit, evicting 
+	another segment if the cache is full. Returns whether there is room, 
+	which there is not if every resident segment is pinned or loading. 
+	The orbit's mutex must be held.
+*/
+static bool orbit_reserve(const ReferenceOrbit& orbit) {
+	if (orbit.resident >= orbit.cache_limit && !orbit_evict(orbit))
+		return false;
+	++orbit.resident;
+	return true;
+}
+
+/*
+	Store staged points into a segment of a checkpointed orbit, whose 
+	room was reserved. The orbit's mutex must be held.
+*/
+static void orbit_insert(const ReferenceOrbit& orbit, unsigned s, const Complex* staged, unsigned count) {
+	orbit_segment_store(orbit.segments[s], staged, count, orbit.storage);
+	orbit.segments[s].last_used = ++orbit.clock;
+}
+
+/*
+	Store a segment the producer finished. A checkpointed orbit drops it 
+	if its cache is full of pinned segments, so that the producer never 
+	waits for kernels, and it gets recomputed when it is read. The 
+	orbit's mutex must be held.
+*/
+static void orbit_finish_segment(const ReferenceOrbit& orbit, unsigned s, const Complex* staged, unsigned count) {
+	if (orbit.checkpoints == nullptr)
+		orbit_segment_store(orbit.segments[s], staged, count, orbit.storage);
+	else if (orbit_reserve(orbit))
+		orbit_insert(orbit, s, staged, count);
+}
+
+/*
+	Unpin a segment of a checkpointed orbit, and wake up kernels waiting 
+	for room in the cache once nobody reads from it anymore. The orbit's 
+	mutex must be held.
+*/
+static void orbit_unpin(const ReferenceOrbit& orbit, unsigned s) {
+	if (--orbit.segments[s].pins == 0)
+		orbit.condition.notify_all();
+}
+
+/*
+	Multiprecision state of the reference orbit at one point.
+*/
+struct OrbitIterator {
+	mpfr_t z_re, z_im, z2_re, z2_im, temp;
+	bool escaped;
+};
+
+static void orbit_iterator_init(OrbitIterator& it, unsigned precision, mpfr_srcptr re, mpfr_srcptr im) {
+	mpfr_inits2(precision, it.z_re, it.z_im, it.z2_re, it.z2_im, it.temp, (mpfr_ptr)0);
+	mpfr_set(it.z_re, re, MPFR_RNDN);
+	mpfr_set(it.z_im, im, MPFR_RNDN);
+	mpfr_sqr(it.z2_re, it.z_re, MPFR_RNDN);
+	mpfr_sqr(it.z2_im, it.z_im, MPFR_RNDN);
+	it.escaped = false;
+}
+
+static void orbit_iterator_clear(OrbitIterator& it) {
+	mpfr_clears(it.z_re, it.z_im, it.z2_re, it.z2_im, it.temp, (mpfr_ptr)0);
+}
+
+/*
+	Round the current point of the orbit to normal precision.
+*/
+static Complex orbit_iterator_point(const OrbitIterator& it) {
+	return Complex{
+		(Real)mpfr_get_float128(it.z_re, MPFR_RNDN),
+		(Real)mpfr_get_float128(it.z_im, MPFR_RNDN)
+	};
+}
+
+/*
+	Advance the orbit by one iteration, and remember whether the new 
+	point escaped the radius.
+*/
+static void orbit_iterator_step(OrbitIterator& it, mpfr_srcptr reference, Real radius) {
+	mpfr_add(it.temp, it.z_re, it.z_re, MPFR_RNDN);
+	mpfr_fma(it.z_im, it.z_im, it.temp, &reference[1], MPFR_RNDN);
+	mpfr_sub(it.z_re, it.z2_re, it.z2_im, MPFR_RNDN);
+	mpfr_add(it.z_re, it.z_re, &reference[0], MPFR_RNDN);
+	mpfr_sqr(it.z2_re, it.z_re, MPFR_RNDN);
+	mpfr_sqr(it.z2_im, it.z_im, MPFR_RNDN);
+	mpfr_add(it.temp, it.z2_re, it.z2_im, MPFR_RNDN);
+	it.escaped = mpfr_cmp_d(it.temp, radius * radius) > 0;
+}
+
+/*
+	Make the first `count` orbit points readable and wake up every
+	kernel waiting for them.
+*/
+static void orbit_publish(ReferenceOrbit& orbit, unsigned count, bool finished) {
+	{
+		std::lock_guard<std::mutex> lock(orbit.mutex);
+		orbit.produced.store(count, std::memory_order_release);
+		if (finished)
+			orbit.finished.store(true, std::memory_order_release);
+	}
+	orbit.condition.notify_all();
+}
+
+/*
+	Calculate orbit points until the capacity is reached or the orbit 
+	escapes, in which case the escaping point is kept. Runs on the 
+	producer thread.
+*/
+static void orbit_produce(ReferenceOrbit& orbit) {
+	const bool checkpointed = orbit.checkpoints != nullptr;
+	OrbitIterator it;
+	mpfr_t zero;
+	mpfr_init2(zero, orbit.precision);
+	mpfr_set_zero(zero, 0);
+	orbit_iterator_init(it, orbit.precision, zero, zero);
+	mpfr_clear(zero);
+
+	// Segments that may be stored as floats or evicted are staged with 
+	// double precision and only published once they are complete, since 
+	// their layout is not known before then. Segment 0 never is.
+	Complex* staged = ((orbit.storage == OrbitStorage::Float || checkpointed) && orbit.segment_count > 1) ?
+		new Complex[ORBIT_SEGMENT_SIZE] : nullptr;
+	Complex* points = nullptr;
+	bool unstored = false;
+
+	unsigned i = 0;
+	while (i < orbit.capacity && !orbit.cancelled.load(std::memory_order_relaxed)) {
+		const unsigned s = i >> ORBIT_SEGMENT_SHIFT, k = i & ORBIT_SEGMENT_MASK;
+		if (k == 0) {
+			if (checkpointed) {
+				mpfr_set(&orbit.checkpoints[2 * s + 0], it.z_re, MPFR_RNDN);
+				mpfr_set(&orbit.checkpoints[2 * s + 1], it.z_im, MPFR_RNDN);
+			}
+			if (staged == nullptr || s == 0) {
+				orbit_segment_allocate(orbit.segments[s], false);
+				points = (Complex*)orbit.segments[s].points;
+				if (checkpointed) {
+					std::lock_guard<std::mutex> lock(orbit.mutex);
+					++orbit.resident;
+				}
+			} else {
+				points = staged;
+				unstored = true;
+			}
+		}
+		points[k] = orbit_iterator_point(it);
+		++i;
+		if (it.escaped)
+			break;
+		orbit_iterator_step(it, orbit.reference, orbit.radius);
+
+		if (points == staged) {
+			if ((i & ORBIT_SEGMENT_MASK) == 0) {
+				{
+					std::lock_guard<std::mutex> lock(orbit.mutex);
+					orbit_finish_segment(orbit, s, staged, ORBIT_SEGMENT_SIZE);
+				}
+				unstored = false;
+				orbit_publish(orbit, i, false);
+			}
+		} else if ((i % ORBIT_PUBLISH_INTERVAL) == 0)
+			orbit_publish(orbit, i, false);
+	}
+
+	// Store the incomplete last segment 
+	if (unstored) {
+		const unsigned s = (i - 1) >> ORBIT_SEGMENT_SHIFT;
+		std::lock_guard<std::mutex> lock(orbit.mutex);
+		orbit_finish_segment(orbit, s, staged, i - (s << ORBIT_SEGMENT_SHIFT));
+	}
+	orbit_publish(orbit, i, true);
+
+	delete[] staged;
+	orbit_iterator_clear(it);
+	mpfr_free_cache();
+}
+
+void orbit_start(
+	ReferenceOrbit& orbit,
+	const mpfr_t real,
+	const mpfr_t imag,
+	unsigned precision,
+	unsigned iterations,
+	Real radius,
+	OrbitStorage storage,
+	size_t cache_bytes 
+) {
+	// Only the segment table is allocated up front, the segments
+	// themselves are allocated as the producer reaches them
+	orbit.capacity = iterations == UINT_MAX ? UINT_MAX : iterations + 1;
+	orbit.segment_count = ((unsigned long long)orbit.capacity + ORBIT_SEGMENT_MASK) >> ORBIT_SEGMENT_SHIFT;
+	orbit.segments = new OrbitSegment[orbit.segment_count]();
+	orbit.storage = storage;
+	orbit.precision = precision;
+	orbit.radius = radius;
+	orbit.resident = 0;
+	orbit.clock = 0;
+	orbit.produced.store(0, std::memory_order_relaxed);
+	orbit.finished.store(false, std::memory_order_relaxed);
+	orbit.cancelled.store(false, std::memory_order_relaxed);
+
+	// The orbit keeps its own copy of the reference position so that 
+	// it does not depend on the lifetime of the caller's values
+	orbit.reference = new __mpfr_struct[2];
+	mpfr_init2(&orbit.reference[0], precision);
+	mpfr_init2(&orbit.reference[1], precision);
+	mpfr_set(&orbit.reference[0], real, MPFR_RNDN);
+	mpfr_set(&orbit.reference[1], imag, MPFR_RNDN);
+
+	// A checkpointed orbit needs a checkpoint for every segment, and its 
+	// cache is sized by segments of double points 
+	orbit.checkpoints = nullptr;
+	orbit.cache_limit = orbit.segment_count;
+	if (cache_bytes != 0) {
+		orbit.checkpoints = new __mpfr_struct[2 * orbit.segment_count];
+		for (unsigned s = 0; s != 2 * orbit.segment_count; ++s)
+			mpfr_init2(&orbit.checkpoints[s], precision);
+		orbit.cache_limit = std::max<size_t>(ORBIT_CACHE_MIN_SEGMENTS, cache_bytes / (2 * sizeof(Real) * ORBIT_SEGMENT_SIZE));
+	}
+
+	orbit.producer = std::thread(orbit_produce, std::ref(orbit));
+}
+
+void orbit_stop(ReferenceOrbit& orbit) {
+	if (orbit.segments == nullptr)
+		return;
+	orbit.cancelled.store(true, std::memory_order_relaxed);
+	if (orbit.producer.joinable())
+		orbit.producer.join();
+	for (unsigned s = 0; s != orbit.segment_count; ++s)
+		orbit_free(orbit.segments[s].points);
+	if (orbit.checkpoints != nullptr) {
+		for (unsigned s = 0; s != 2 * orbit.segment_count; ++s)
+			mpfr_clear(&orbit.checkpoints[s]);
+		delete[] orbit.checkpoints;
+		orbit.checkpoints = nullptr;
+	}
+	mpfr_clears(&orbit.reference[0], &orbit.reference[1], (mpfr_ptr)0);
+	delete[] orbit.reference;
+	delete[] orbit.segments;
+	orbit.segments = nullptr;
+	orbit.segment_count = 0;
+}
+
+unsigned orbit_wait(const ReferenceOrbit& orbit, unsigned index) {
+	unsigned produced = orbit.produced.load(std::memory_order_acquire);
+	if (produced > index || orbit.finished.load(std::memory_order_acquire))
+		return produced;
+
+	std::unique_lock<std::mutex> lock(orbit.mutex);
+	orbit.condition.wait(lock, [&orbit, index]() {
+		return orbit.produced.load(std::memory_order_relaxed) > index ||
+			   orbit.finished.load(std::memory_order_relaxed);
+	});
+	return orbit.produced.load(std::memory_order_acquire);
+}
+
+void orbit_seek(OrbitCursor& cursor, unsigned s) {
+	const ReferenceOrbit& orbit = *cursor.orbit;
+	OrbitSegment& segment = orbit.segments[s];
+
+	// Segments of an orbit that is not checkpointed stay put 
+	if (orbit.checkpoints == nullptr) {
+		cursor.segment = &segment;
+		cursor.index = s;
+		return;
+	}
+
+	// Move the pin over to the new segment, and wait if some other 
+	// cursor is recomputing it 
+	std::unique_lock<std::mutex> lock(orbit.mutex);
+	if (cursor.index != 0)
+		orbit_unpin(orbit, cursor.index);
+	++segment.pins;
+	segment.last_used = ++orbit.clock;
+	cursor.segment = &segment;
+	cursor.index = s;
+	orbit.condition.wait(lock, [&segment]() { return !segment.loading; });
+	if (segment.points != nullptr)
+		return;
+
+	// Recompute the evicted segment from its checkpoint, without holding 
+	// the lock as that takes a while. Its room in the cache is reserved 
+	// first, waiting for other kernels to unpin segments if needed, so 
+	// that pinned segments never exceed the cache limit. 
+	segment.loading = true;
+	orbit.condition.wait(lock, [&orbit]() { return orbit_reserve(orbit); });
+	lock.unlock();
+
+	const unsigned count = std::min<unsigned>(ORBIT_SEGMENT_SIZE,
+		orbit.produced.load(std::memory_order_acquire) - (s << ORBIT_SEGMENT_SHIFT));
+	Complex* staged = new Complex[count];
+	OrbitIterator it;
+	orbit_iterator_init(it, orbit.precision, &orbit.checkpoints[2 * s + 0], &orbit.checkpoints[2 * s + 1]);
+	for (unsigned k = 0; k != count; ++k) {
+		staged[k] = orbit_iterator_point(it);
+		if (k + 1 != count)
+			orbit_iterator_step(it, orbit.reference, orbit.radius);
+	}
+	orbit_iterator_clear(it);
+
+	lock.lock();
+	orbit_insert(orbit, s, staged, count);
+	segment.loading = false;
+	lock.unlock();
+	orbit.condition.notify_all();
+	delete[] staged;
+}
+
+void orbit_release(OrbitCursor& cursor) {
+	const ReferenceOrbit& orbit = *cursor.orbit;
+	if (orbit.checkpoints != nullptr && cursor.index != 0) {
+		std::lock_guard<std::mutex> lock(orbit.mutex);
+		orbit_unpin(orbit, cursor.index);
+	}
+	cursor.segment = nullptr;
+	cursor.index = 0;
+}
@@ -0,0 +1,227 @@
+/**
+ *    ========== Mandelbrot Fractal Renderer ==========
+ * A command-line utility for rendering the Mandelbrot set.
+ * 
+ * Author: bambamboo15
+ */
+#pragma once
+#include "datatypes.hpp"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+	The reference orbit is stored in segments of a fixed power-of-two
+	size. A segment is only allocated once the producer reaches it, so
+	unused capacity never takes up memory. A segment of double points 
+	spans two huge pages, and a segment of float points spans one.
+*/
+#define ORBIT_SEGMENT_SHIFT 18
+#define ORBIT_SEGMENT_SIZE (1u << ORBIT_SEGMENT_SHIFT)
+#define ORBIT_SEGMENT_MASK (ORBIT_SEGMENT_SIZE - 1)
+
+/*
+	Number of orbit points the producer computes before publishing
+	them to waiting kernels.
+*/
+#define ORBIT_PUBLISH_INTERVAL 1024
+
+/*
+	How many orbit points ahead of the current one kernels prefetch.
+*/
+#define ORBIT_PREFETCH_DISTANCE 16
+
+/*
+	Size of a (transparent) huge page, which segments are aligned to.
+*/
+#define ORBIT_HUGE_PAGE_SIZE (2u << 20)
+
+/*
+	Fewest segments a checkpointed orbit keeps resident. The first 
+	segment is never evicted, and with a single other one, kernels 
+	reading different segments evict each other's on every block.
+*/
+#define ORBIT_CACHE_MIN_SEGMENTS 3
+
+/*
+	How the reference orbit points are stored. With `Float`, a segment 
+	is stored with single precision when every one of its values is 
+	representable as a normal float, and with double precision 
+	otherwise. The first segment, which every rebase returns to, is 
+	always stored with double precision.
+
+	Rounding a point Z to a float only changes a pixel's step by 
+	2 dz times the rounding error, which is relative to the delta dz 
+	rather than to the pixel spacing, so floats are as precise at 
+	every depth. It only shows where the full value Z + dz is much 
+	smaller than Z, which is where pixels rebase onto the first 
+	segment.
+*/
+enum class OrbitStorage {
+	Double,
+	Float 
+};
+
+/*
+	A segment of the reference orbit. Points are stored as interleaved 
+	(re, im) pairs.
+
+	The bookkeeping fields are only used by checkpointed orbits, where 
+	segments may be evicted and recomputed, and are guarded by the 
+	orbit's mutex.
+*/
+struct OrbitSegment {
+	void* points;						/* interleaved (re, im) pairs (null if not resident) */
+	bool single;						/* whether values are floats instead of doubles */
+	bool loading;						/* whether the segment is being recomputed */
+	unsigned pins;						/* number of cursors reading the segment */
+	unsigned long long last_used;		/* when the segment was last pinned */
+};
+
+/*
+	Reference orbit for perturbation, extended lazily by a background
+	thread. Kernels may read every point below `produced`, and only
+	have to wait when they outrun the producer.
+
+	A checkpointed orbit only keeps the multiprecision point at the 
+	start of every segment, and a bounded number of segments. Segments 
+	that were evicted are recomputed from their checkpoint on demand.
+*/
+struct ReferenceOrbit {
+	OrbitSegment* segments = nullptr;			/* segment table (null if the orbit was never started) */
+	unsigned segment_count = 0;					/* number of entries in the segment table */
+	unsigned capacity;							/* maximum number of orbit points */
+	OrbitStorage storage;						/* how the orbit points are stored */
+	unsigned precision;							/* precision in bits */
+	Real radius;								/* escape radius */
+	mpfr_ptr reference;							/* reference position (real, imag) */
+	mpfr_ptr checkpoints;						/* (re, im) at the start of every segment, or null */
+	unsigned cache_limit;						/* maximum resident segments of a checkpointed orbit */
+	mutable unsigned resident;					/* resident (or reserved) segments of a checkpointed orbit */
+	mutable unsigned long long clock;			/* pin counter for least-recently-used eviction */
+	std::atomic<unsigned> produced;				/* number of orbit points readable by kernels */
+	std::atomic<bool> finished;					/* whether `produced` is the final length */
+	std::atomic<bool> cancelled;				/* whether the producer should stop early */
+	mutable std::mutex mutex;					/* guards waiting on `produced` and the segment cache */
+	mutable std::condition_variable condition;	/* signalled whenever points are published or loaded */
+	std::thread producer;						/* background thread computing the orbit */
+};
+
+/*
+	A kernel's view of the reference orbit. It keeps the segment it 
+	reads from pinned, so that a checkpointed orbit cannot evict it. 
+	Segment 0, which every rebase returns to, is never evicted and 
+	never pinned.
+*/
+struct OrbitCursor {
+	const ReferenceOrbit* orbit;		/* the orbit being read */
+	const OrbitSegment* segment;		/* the pinned segment, if any */
+	unsigned index;						/* index of the pinned segment (0 if none) */
+};
+
+/*
+	Start computing the reference orbit at (real, imag) in the
+	background. At most `iterations + 1` points are produced (and no 
+	more than UINT_MAX), fewer if the orbit escapes the radius (the 
+	escaping point is kept).
+
+	If `cache_bytes` is not zero, the orbit is checkpointed and keeps 
+	roughly that many bytes of segments resident (at least 
+	ORBIT_CACHE_MIN_SEGMENTS). Pinned segments count against that 
+	limit: a cursor that needs an evicted segment while every resident 
+	one is pinned waits until another cursor moves on. That wait only 
+	ends if every thread reading the orbit holds at most one cursor, 
+	and releases it before it waits for other threads (at a barrier, a 
+	lock or a queue).
+*/
+void orbit_start(
+	ReferenceOrbit& orbit,
+	const mpfr_t real,
+	const mpfr_t imag,
+	unsigned precision,
+	unsigned iterations,
+	Real radius,
+	OrbitStorage storage,
+	size_t cache_bytes 
+);
+
+/*
+	Stop the producer and free every segment of the orbit. Does 
+	nothing if the orbit was never started.
+*/
+void orbit_stop(ReferenceOrbit& orbit);
+
+/*
+	Block until the orbit point at `index` is readable or the orbit
+	has ended, then return the number of readable points.
+*/
+unsigned orbit_wait(const ReferenceOrbit& orbit, unsigned index);
+
+/*
+	Check whether the orbit point at `index` exists, waiting for the
+	producer if it has not been reached yet. `available` is a cached
+	copy of the readable length that is refreshed when needed.
+*/
+__attribute__((always_inline)) inline bool orbit_has(const ReferenceOrbit& orbit, unsigned& available, unsigned index) {
+	return index < available || (available = orbit_wait(orbit, index)) > index;
+}
+
+/*
+	Create a cursor that reads from an orbit.
+*/
+inline OrbitCursor orbit_cursor(const ReferenceOrbit& orbit) {
+	return OrbitCursor{&orbit, nullptr, 0};
+}
+
+/*
+	Move a cursor to a segment other than segment 0, recomputing the 
+	segment if it is not resident. The cursor's previous segment is 
+	unpinned before it waits for room in the cache.
+*/
+void orbit_seek(OrbitCursor& cursor, unsigned segment);
+
+/*
+	Unpin the segment a cursor reads from. Must be called before the 
+	cursor is discarded.
+*/
+void orbit_release(OrbitCursor& cursor);
+
+/*
+	Find the segment holding the orbit point at `index`.
+*/
+__attribute__((always_inline)) inline const OrbitSegment& orbit_segment_of(OrbitCursor& cursor, unsigned index) {
+	const unsigned segment = index >> ORBIT_SEGMENT_SHIFT;
+	if (segment == 0)
+		return cursor.orbit->segments[0];
+	if (segment != cursor.index)
+		orbit_seek(cursor, segment);
+	return *cursor.segment;
+}
+
+/*
+	Read an orbit point. The caller must know that it has been
+	produced.
+*/
+__attribute__((always_inline)) inline Complex orbit_at(OrbitCursor& cursor, unsigned index) {
+	const OrbitSegment& segment = orbit_segment_of(cursor, index);
+	const unsigned offset = index & ORBIT_SEGMENT_MASK;
+	if (segment.single) {
+		const float* point = (const float*)segment.points + 2 * offset;
+		return Complex{point[0], point[1]};
+	}
+	return ((const Complex*)segment.points)[offset];
+}
+
+/*
+	Hint that the orbit point at `index + ORBIT_PREFETCH_DISTANCE` will 
+	be read soon. Prefetches never fault, so this is safe to call for 
+	points that do not exist. It only looks at the segment the cursor 
+	is already on.
+*/
+__attribute__((always_inline)) inline void orbit_prefetch(const OrbitCursor& cursor, unsigned index) {
+	const OrbitSegment& segment = (index >> ORBIT_SEGMENT_SHIFT) == 0 ?
+		cursor.orbit->segments[0] : *cursor.segment;
+	const unsigned offset = (index & ORBIT_SEGMENT_MASK) + ORBIT_PREFETCH_DISTANCE;
+	__builtin_prefetch((const char*)segment.points + offset * (segment.single ? 2 * sizeof(float) : sizeof(Complex)));
+}